@@ -0,0 +1,377 @@
+//
+// Microbenchmarks of the hot paths of libsimplehttp, mdns and the lamp
+//
+// Usage: bench [-n iterations] [-f prefix] [-j]
+//
+// Runs every benchmark whose name starts with `prefix` (all by default)
+// `iterations` times and prints the time per operation, with `-j` as one
+// line of JSON per benchmark.
+//
+// Requests are parsed once as a whole and once fed to the parser one byte
+// at a time, like a request trickling in over a bad Wi-Fi link. The parser
+// looks at every byte once, so both should cost about the same per byte.
+// Responses go to /dev/null, sending fails right away so only parsing and
+// routing is measured. mdns packets are dropped by the host platform.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <simplehttp/http.h>
+#include <mdns/mdns.h>
+#include <cJSON.h>
+
+#include "../shttp/parser.h"
+#include "../shttp/router.h"
+#include "../shttp/metrics.h"
+#include "../shttp/urlcoder.h"
+#include "mdns_publish.h"
+
+extern volatile shttpConfig *shttpServerConfig;
+
+typedef struct _benchConfig {
+    uint32_t iterations;
+    const char *filter;
+    bool json;
+} benchConfig;
+
+typedef struct _benchRequest {
+    const char *name;
+    const char *data;
+} benchRequest;
+
+static const benchRequest requests[] = {
+    { "page_load", "GET /main.js HTTP/1.1\r\n"
+        "Host: wohnzimmerlampe.local\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+        "Accept: */*\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Connection: keep-alive\r\n"
+        "Referer: http://wohnzimmerlampe.local/\r\n"
+        "If-None-Match: \"5d1f3a\"\r\n"
+        "Cache-Control: max-age=0\r\n"
+        "\r\n" },
+    { "slider_post", "POST /parameters HTTP/1.1\r\n"
+        "Host: wohnzimmerlampe.local\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: 85\r\n"
+        "\r\n"
+        "{\"hue\":0.5,\"saturation\":0.8,\"brightness\":0.7,\"lowPower\":0.2,\"highPower\":0.1,\"mode\":1}" },
+    { "query", "GET /parameters?hue=0.5&saturation=0.8&brightness=0.7&mode=white HTTP/1.1\r\n"
+        "Host: wohnzimmerlampe.local\r\n"
+        "\r\n" },
+    { NULL, NULL }
+};
+
+// paths looked up in the route tree of the lamp
+static const char *routePaths[] = {
+    "/", "/main.css", "/colorwheel.jpg", "/parameters", "/parameters/socket", "/firmware/", "/nothere", NULL
+};
+
+static const char *parametersBody = "{\"hue\":0.5,\"saturation\":0.8,\"brightness\":0.7,\"lowPower\":0.2,\"highPower\":0.1,\"mode\":\"white\"}";
+
+static shttpResponse *benchRoute(shttpRequest *request, void *userData) {
+    return shttp_empty_response(shttpStatusOK);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool selected(benchConfig *config, const char *name) {
+    return (config->filter == NULL) || (strncmp(name, config->filter, strlen(config->filter)) == 0);
+}
+
+// print the result of one benchmark, `bytes` is the input size per operation or 0
+static void report(benchConfig *config, const char *name, uint64_t elapsed, uint32_t bytes) {
+    double perOp = (double)elapsed / config->iterations;
+
+    if (config->json) {
+        printf("{\"name\":\"%s\",\"iterations\":%u,\"ns_per_op\":%.1f", name, config->iterations, perOp);
+        if (bytes > 0) {
+            printf(",\"bytes\":%u,\"ns_per_byte\":%.2f", bytes, perOp / bytes);
+        }
+        printf("}\n");
+    } else if (bytes > 0) {
+        printf("%-36s %10.0f ns/op  %5u bytes  %6.2f ns/byte\n", name, perOp, bytes, perOp / bytes);
+    } else {
+        printf("%-36s %10.0f ns/op\n", name, perOp);
+    }
+}
+
+//
+// Parser
+//
+
+// feed `data` to the parser in parts of `step` bytes, returns false if the
+// route was not reached
+static bool parse(shttpParserState *state, int socket, const char *data, uint16_t len, uint16_t step) {
+    shttpConnectionState result = shttpConnectionKeepAlive;
+
+    for (uint32_t offset = 0; offset < len; offset += step) {
+        uint16_t space;
+        char *buffer = shttp_parser_buffer(state, &space);
+        uint16_t part = (len - offset < step) ? len - offset : step;
+        if (part > space) {
+            return false;
+        }
+        memcpy(buffer, data + offset, part);
+        result = shttp_parse(state, part, socket);
+        if ((result != shttpConnectionKeepAlive) && (offset + part < len)) {
+            return false;
+        }
+    }
+
+    // the response could not be sent, that closes the connection
+    shttp_parser_reset(state);
+    return result == shttpConnectionClose;
+}
+
+static bool benchParser(benchConfig *config) {
+    static uint32_t staticChunk[SHTTP_STATIC_CHUNK / 4];
+    int socket = open("/dev/null", O_WRONLY);
+    shttpParserState *state = shttp_parser_init_state(staticChunk);
+    if ((socket < 0) || (state == NULL)) {
+        fprintf(stderr, "could not set up parser\n");
+        return false;
+    }
+
+    for (const benchRequest *request = requests; request->name != NULL; request++) {
+        uint16_t len = strlen(request->data);
+
+        for (uint8_t bytewise = 0; bytewise < 2; bytewise++) {
+            char name[64];
+            snprintf(name, sizeof(name), "parse/%s/%s", request->name, (bytewise) ? "bytewise" : "whole");
+            if (!selected(config, name)) {
+                continue;
+            }
+
+            uint64_t start = now_ns();
+            for (uint32_t i = 0; i < config->iterations; i++) {
+                if (!parse(state, socket, request->data, len, (bytewise) ? 1 : UINT16_MAX)) {
+                    fprintf(stderr, "%s: parse failed\n", name);
+                    return false;
+                }
+            }
+            report(config, name, now_ns() - start, len);
+        }
+    }
+
+    shttp_destroy_parser(state);
+    close(socket);
+    return true;
+}
+
+//
+// Router
+//
+
+static bool benchRouter(benchConfig *config) {
+    char *pathParameters[SHTTP_MAX_PATH_PARAMETERS];
+    shttpRequest request;
+    memset(&request, 0, sizeof(request));
+    request.pathParameters = pathParameters;
+
+    for (const char **path = routePaths; *path != NULL; path++) {
+        char name[64];
+        snprintf(name, sizeof(name), "route%s", *path);
+        if (!selected(config, name)) {
+            continue;
+        }
+
+        // the router strips trailing slashes in place, work on a copy
+        char buffer[64];
+        shttpMethod allowed;
+        uint64_t start = now_ns();
+        for (uint32_t i = 0; i < config->iterations; i++) {
+            strcpy(buffer, *path);
+            request.numPathParameters = 0;
+            shttp_find_route(buffer, shttpMethodGET, &request, &allowed);
+        }
+        report(config, name, now_ns() - start, 0);
+    }
+    return true;
+}
+
+//
+// URL coding
+//
+
+static bool benchURLCoding(benchConfig *config) {
+    char decoded[] = "hue=0.5&mode=white & cinema/moodlight?";
+    char encoded[] = "hue%3D0.5%26mode%3Dwhite+%26+cinema%2Fmoodlight%3F";
+
+    if (selected(config, "url/decode")) {
+        uint64_t start = now_ns();
+        for (uint32_t i = 0; i < config->iterations; i++) {
+            free(shttp_url_decode_buffer(encoded, strlen(encoded)));
+        }
+        report(config, "url/decode", now_ns() - start, strlen(encoded));
+    }
+
+    if (selected(config, "url/encode")) {
+        uint64_t start = now_ns();
+        for (uint32_t i = 0; i < config->iterations; i++) {
+            free(shttp_url_encode_buffer(decoded, strlen(decoded)));
+        }
+        report(config, "url/encode", now_ns() - start, strlen(decoded));
+    }
+    return true;
+}
+
+//
+// mdns
+//
+
+static bool benchMDNS(benchConfig *config) {
+    if (!selected(config, "mdns/announce")) {
+        return true;
+    }
+
+    // not started, so nothing is listening and packets are just dropped
+    mdnsHandle *handle = mdns_create("wohnzimmerlampe");
+    struct ip_addr ip = { 0x0a01a8c0 };
+    mdns_update_ip(handle, ip);
+    mdnsService *service = mdns_create_service("_http", mdnsProtocolTCP, 80);
+    mdns_add_service(handle, service);
+
+    // builds the full response packet with PTR, SRV, TXT and A records
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < config->iterations; i++) {
+        mdns_announce(handle);
+    }
+    report(config, "mdns/announce", now_ns() - start, 0);
+
+    mdns_destroy(handle);
+    return true;
+}
+
+//
+// JSON of /parameters
+//
+
+// the body of GET /parameters
+static void writeParameters(shttpJSONWriter *json, void *userData) {
+    shttp_json_object(json, NULL);
+    shttp_json_number(json, "hue", 0.5);
+    shttp_json_number(json, "saturation", 0.8);
+    shttp_json_number(json, "brightness", 0.7);
+    shttp_json_number(json, "lowPower", 0.2);
+    shttp_json_number(json, "highPower", 0.1);
+    shttp_json_string(json, "mode", "white");
+    shttp_json_end(json);
+}
+
+static bool benchJSON(benchConfig *config) {
+    if (selected(config, "json/parameters_parse")) {
+        // what POST /parameters does with the body
+        uint64_t start = now_ns();
+        double sum = 0;
+        for (uint32_t i = 0; i < config->iterations; i++) {
+            cJSON *root = cJSON_Parse(parametersBody);
+            cJSON *item;
+            if ((item = cJSON_GetObjectItem(root, "hue")) != NULL) sum += item->valuedouble;
+            if ((item = cJSON_GetObjectItem(root, "saturation")) != NULL) sum += item->valuedouble;
+            if ((item = cJSON_GetObjectItem(root, "brightness")) != NULL) sum += item->valuedouble;
+            if ((item = cJSON_GetObjectItem(root, "lowPower")) != NULL) sum += item->valuedouble;
+            if ((item = cJSON_GetObjectItem(root, "highPower")) != NULL) sum += item->valuedouble;
+            if ((item = cJSON_GetObjectItem(root, "mode")) != NULL) sum += strlen(item->valuestring);
+            cJSON_Delete(root);
+        }
+        report(config, "json/parameters_parse", now_ns() - start, strlen(parametersBody));
+        if (sum < 0) {
+            printf("unreachable\n");
+        }
+    }
+
+    if (selected(config, "json/parameters_build")) {
+        // what GET /parameters sends, measured and written into the send buffer
+        uint64_t start = now_ns();
+        uint32_t len = 0;
+        for (uint32_t i = 0; i < config->iterations; i++) {
+            char buffer[SHTTP_RESPONSE_BUFFER];
+            len = shttp_json_format(NULL, 0, writeParameters, NULL);
+            shttp_json_format(buffer, sizeof(buffer), writeParameters, NULL);
+        }
+        report(config, "json/parameters_build", now_ns() - start, len);
+    }
+
+    if (selected(config, "json/parameters_cjson")) {
+        // the same as cJSON tree, for comparison
+        uint64_t start = now_ns();
+        uint32_t len = 0;
+        for (uint32_t i = 0; i < config->iterations; i++) {
+            cJSON *root = cJSON_CreateObject();
+            cJSON_AddItemToObject(root, "hue", cJSON_CreateNumber(0.5));
+            cJSON_AddItemToObject(root, "saturation", cJSON_CreateNumber(0.8));
+            cJSON_AddItemToObject(root, "brightness", cJSON_CreateNumber(0.7));
+            cJSON_AddItemToObject(root, "lowPower", cJSON_CreateNumber(0.2));
+            cJSON_AddItemToObject(root, "highPower", cJSON_CreateNumber(0.1));
+            cJSON_AddItemToObject(root, "mode", cJSON_CreateString("white"));
+            char *text = cJSON_PrintUnformatted(root);
+            len = strlen(text);
+            free(text);
+            cJSON_Delete(root);
+        }
+        report(config, "json/parameters_cjson", now_ns() - start, len);
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    benchConfig config = { 100000, NULL, false };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:f:j")) != -1) {
+        switch (opt) {
+            case 'n': config.iterations = atoi(optarg); break;
+            case 'f': config.filter = optarg; break;
+            case 'j': config.json = true; break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [-f prefix] [-j]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (config.iterations == 0) {
+        return 1;
+    }
+
+    // the routes of the lamp
+    shttpRoute *routes[] = {
+        shttp_route(shttpMethodGET, "/", benchRoute, NULL),
+        shttp_route(shttpMethodGET, "/main.css", benchRoute, NULL),
+        shttp_route(shttpMethodGET, "/main.js", benchRoute, NULL),
+        shttp_route(shttpMethodGET, "/colorwheel.jpg", benchRoute, NULL),
+        shttp_route(shttpMethodGET, "/hexagon.png", benchRoute, NULL),
+        shttp_route(shttpMethodGET, "/favicon.ico", benchRoute, NULL),
+        shttp_route(shttpMethodGET | shttpMethodPOST, "/parameters", benchRoute, NULL),
+        shttp_route(shttpMethodGET, "/parameters/socket", benchRoute, NULL),
+        shttp_route(shttpMethodGET, "/events", benchRoute, NULL),
+        shttp_route(shttpMethodGET | shttpMethodPOST, "/firmware", benchRoute, NULL),
+        NULL
+    };
+    shttpConfig serverConfig = { "wohnzimmerlampe.local", "80", true, routes };
+    shttpServerConfig = &serverConfig;
+    if ((!shttp_compile_routes(routes)) || (!shttp_metrics_init(routes))) {
+        fprintf(stderr, "could not compile routes\n");
+        return 1;
+    }
+
+    bool ok = benchParser(&config) &&
+        benchRouter(&config) &&
+        benchURLCoding(&config) &&
+        benchMDNS(&config) &&
+        benchJSON(&config);
+
+    shttp_metrics_destroy(routes);
+    shttp_destroy_routes();
+    return (ok) ? 0 : 1;
+}
@@ -0,0 +1,37 @@
+#include <esp_common.h>
+#include <malloc.h>
+#include <time.h>
+
+#include "host.h"
+
+static wifi_event_handler_cb_t wifiEventHandler = NULL;
+
+bool wifi_set_event_handler_cb(wifi_event_handler_cb_t cb) {
+    wifiEventHandler = cb;
+    return true;
+}
+
+void host_send_wifi_event(System_Event_t *event) {
+    if (wifiEventHandler != NULL) {
+        wifiEventHandler(event);
+    }
+}
+
+const char *system_get_sdk_version(void) {
+    return "host";
+}
+
+flash_size_map system_get_flash_size_map(void) {
+    return FLASH_SIZE_32M_MAP_512_512;
+}
+
+uint32 system_get_free_heap_size(void) {
+    struct mallinfo2 info = mallinfo2();
+    return (uint32)info.fordblks;
+}
+
+uint32 system_get_time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32)(now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
@@ -0,0 +1,147 @@
+#include <esp_common.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+//
+// File backed SPI flash. The image has the size of the flash map reported
+// by `system_get_flash_size_map` (4 MB), it is created erased (all 0xff) on
+// first use. Like NOR flash a write can only clear bits, so writing
+// without erasing the sector first corrupts the data just as on the device.
+//
+// Set FLASH_IMAGE to choose the file, default is `build/flash.bin`.
+// The file is fast, to see the throughput of real flash set
+// FLASH_ERASE_MS (time per sector erase, around 50 on the device) and
+// FLASH_PROGRAM_US (time per 256 byte page, around 700).
+//
+
+#define FLASH_SIZE (4 * 1024 * 1024)
+#define FLASH_PAGE_SIZE 256
+
+static pthread_mutex_t flashLock = PTHREAD_MUTEX_INITIALIZER;
+static int flashFile = -1;
+
+static uint8 upgradeFlag = UPGRADE_FLAG_IDLE;
+static uint8 runningBin = UPGRADE_FW_BIN1;
+
+// emulate the time flash operations take, `variable` is in `multiplier` microseconds
+static void host_flash_delay(const char *variable, uint32 units, uint32 multiplier) {
+    char *value = getenv(variable);
+    if (value != NULL) {
+        usleep((useconds_t)atoi(value) * units * multiplier);
+    }
+}
+
+// open the image and fill it up to the flash size, call with the lock held
+static bool host_flash_open(void) {
+    if (flashFile >= 0) {
+        return true;
+    }
+
+    char *path = getenv("FLASH_IMAGE");
+    if (path == NULL) {
+        path = "build/flash.bin";
+    }
+
+    flashFile = open(path, O_RDWR | O_CREAT, 0644);
+    if (flashFile < 0) {
+        perror("flash: could not open image");
+        return false;
+    }
+
+    off_t size = lseek(flashFile, 0, SEEK_END);
+    if (size < FLASH_SIZE) {
+        uint8 erased[SPI_FLASH_SEC_SIZE];
+        memset(erased, 0xff, sizeof(erased));
+        for (off_t offset = size - (size % SPI_FLASH_SEC_SIZE); offset < FLASH_SIZE; offset += SPI_FLASH_SEC_SIZE) {
+            if (pwrite(flashFile, erased, sizeof(erased), offset) != sizeof(erased)) {
+                perror("flash: could not initialize image");
+                close(flashFile);
+                flashFile = -1;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool host_flash_range_valid(uint32 address, uint32 size) {
+    // the SDK only does word aligned transfers
+    return ((address % 4) == 0) && ((size % 4) == 0) && (address + size <= FLASH_SIZE) && (address + size >= address);
+}
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec) {
+    uint8 erased[SPI_FLASH_SEC_SIZE];
+    memset(erased, 0xff, sizeof(erased));
+
+    if ((uint32)sec * SPI_FLASH_SEC_SIZE >= FLASH_SIZE) {
+        return SPI_FLASH_RESULT_ERR;
+    }
+
+    pthread_mutex_lock(&flashLock);
+    bool ok = host_flash_open() && (pwrite(flashFile, erased, sizeof(erased), (off_t)sec * SPI_FLASH_SEC_SIZE) == sizeof(erased));
+    pthread_mutex_unlock(&flashLock);
+
+    host_flash_delay("FLASH_ERASE_MS", 1, 1000);
+    return (ok) ? SPI_FLASH_RESULT_OK : SPI_FLASH_RESULT_ERR;
+}
+
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size) {
+    if (!host_flash_range_valid(des_addr, size)) {
+        return SPI_FLASH_RESULT_ERR;
+    }
+
+    uint8 *data = malloc(size);
+    if (data == NULL) {
+        return SPI_FLASH_RESULT_ERR;
+    }
+
+    pthread_mutex_lock(&flashLock);
+    bool ok = host_flash_open() && (pread(flashFile, data, size, des_addr) == size);
+    if (ok) {
+        // programming only turns ones into zeros
+        for (uint32 i = 0; i < size; i++) {
+            data[i] &= ((uint8 *)src_addr)[i];
+        }
+        ok = (pwrite(flashFile, data, size, des_addr) == size);
+    }
+    pthread_mutex_unlock(&flashLock);
+
+    free(data);
+    host_flash_delay("FLASH_PROGRAM_US", (size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE, 1);
+    return (ok) ? SPI_FLASH_RESULT_OK : SPI_FLASH_RESULT_ERR;
+}
+
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size) {
+    if (!host_flash_range_valid(src_addr, size)) {
+        return SPI_FLASH_RESULT_ERR;
+    }
+
+    pthread_mutex_lock(&flashLock);
+    bool ok = host_flash_open() && (pread(flashFile, des_addr, size, src_addr) == size);
+    pthread_mutex_unlock(&flashLock);
+
+    return (ok) ? SPI_FLASH_RESULT_OK : SPI_FLASH_RESULT_ERR;
+}
+
+void system_upgrade_flag_set(uint8 flag) {
+    upgradeFlag = flag;
+}
+
+uint8 system_upgrade_flag_check(void) {
+    return upgradeFlag;
+}
+
+uint8 system_upgrade_userbin_check(void) {
+    return runningBin;
+}
+
+void system_upgrade_reboot(void) {
+    if (upgradeFlag != UPGRADE_FLAG_FINISH) {
+        return;
+    }
+
+    runningBin = (runningBin == UPGRADE_FW_BIN1) ? UPGRADE_FW_BIN2 : UPGRADE_FW_BIN1;
+    upgradeFlag = UPGRADE_FLAG_IDLE;
+    printf("flash: reboot into user%d.bin\n", runningBin + 1);
+}
@@ -0,0 +1,216 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+
+//
+// Queue: fixed size ring buffer guarded by a mutex and two condition variables
+//
+
+struct _hostQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+
+    unsigned long length;
+    unsigned long itemSize;
+    unsigned long head;
+    unsigned long count;
+
+    char *items;
+};
+
+struct _hostTask {
+    pthread_t thread;
+    pdTASK_CODE *code;
+    void *userData;
+};
+
+static struct timespec host_deadline(portTickType ticks) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    uint64_t ns = (uint64_t)ticks * portTICK_RATE_MS * 1000000ULL;
+    ts.tv_sec += ns / 1000000000ULL;
+    ts.tv_nsec += ns % 1000000000ULL;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    return ts;
+}
+
+// wait on `cond` until `predicate` holds, returns false on timeout
+#define QUEUE_WAIT(_queue, _cond, _predicate, _ticks) ({ \
+    bool _ok = true; \
+    struct timespec _deadline = host_deadline(_ticks); \
+    while (!(_predicate)) { \
+        if ((_ticks) == portMAX_DELAY) { \
+            pthread_cond_wait(&(_queue)->_cond, &(_queue)->lock); \
+        } else if (pthread_cond_timedwait(&(_queue)->_cond, &(_queue)->lock, &_deadline) == ETIMEDOUT) { \
+            _ok = (_predicate); \
+            break; \
+        } \
+    } \
+    _ok; \
+})
+
+xQueueHandle xQueueCreate(unsigned long length, unsigned long itemSize) {
+    xQueueHandle queue = calloc(1, sizeof(struct _hostQueue));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    queue->items = malloc(length * itemSize);
+    if (queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+    queue->length = length;
+    queue->itemSize = itemSize;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->notEmpty, NULL);
+    pthread_cond_init(&queue->notFull, NULL);
+
+    return queue;
+}
+
+void vQueueDelete(xQueueHandle queue) {
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->notEmpty);
+    pthread_cond_destroy(&queue->notFull);
+    free(queue->items);
+    free(queue);
+}
+
+portBASE_TYPE xQueueSendToBack(xQueueHandle queue, const void *item, portTickType ticksToWait) {
+    pthread_mutex_lock(&queue->lock);
+    if (!QUEUE_WAIT(queue, notFull, queue->count < queue->length, ticksToWait)) {
+        pthread_mutex_unlock(&queue->lock);
+        return pdFALSE;
+    }
+
+    unsigned long tail = (queue->head + queue->count) % queue->length;
+    memcpy(queue->items + tail * queue->itemSize, item, queue->itemSize);
+    queue->count++;
+
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+static portBASE_TYPE host_queue_fetch(xQueueHandle queue, void *item, portTickType ticksToWait, bool remove) {
+    pthread_mutex_lock(&queue->lock);
+    if (!QUEUE_WAIT(queue, notEmpty, queue->count > 0, ticksToWait)) {
+        pthread_mutex_unlock(&queue->lock);
+        return pdFALSE;
+    }
+
+    memcpy(item, queue->items + queue->head * queue->itemSize, queue->itemSize);
+    if (remove) {
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        pthread_cond_signal(&queue->notFull);
+    } else {
+        // a peek leaves the item for the next receiver
+        pthread_cond_signal(&queue->notEmpty);
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return pdTRUE;
+}
+
+portBASE_TYPE xQueueReceive(xQueueHandle queue, void *item, portTickType ticksToWait) {
+    return host_queue_fetch(queue, item, ticksToWait, true);
+}
+
+portBASE_TYPE xQueuePeek(xQueueHandle queue, void *item, portTickType ticksToWait) {
+    return host_queue_fetch(queue, item, ticksToWait, false);
+}
+
+unsigned long uxQueueMessagesWaiting(xQueueHandle queue) {
+    pthread_mutex_lock(&queue->lock);
+    unsigned long count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+//
+// Tasks
+//
+
+static void *host_task_entry(void *userData) {
+    xTaskHandle task = userData;
+    task->code(task->userData);
+
+    // FreeRTOS tasks must not return, but be lenient here
+    free(task);
+    return NULL;
+}
+
+portBASE_TYPE xTaskCreate(pdTASK_CODE *code, const char *name, unsigned short stackDepth, void *userData, unsigned long priority, xTaskHandle *handle) {
+    xTaskHandle task = calloc(1, sizeof(struct _hostTask));
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    task->code = code;
+    task->userData = userData;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int result = pthread_create(&task->thread, &attr, host_task_entry, task);
+    pthread_attr_destroy(&attr);
+    if (result != 0) {
+        free(task);
+        return pdFAIL;
+    }
+
+#ifdef _GNU_SOURCE
+    // pthread names are limited to 16 bytes including the terminator
+    char threadName[16];
+    snprintf(threadName, sizeof(threadName), "%s", name);
+    pthread_setname_np(task->thread, threadName);
+#endif
+
+    if (handle != NULL) {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(xTaskHandle task) {
+    if ((task == NULL) || pthread_equal(task->thread, pthread_self())) {
+        pthread_exit(NULL);
+    }
+    pthread_cancel(task->thread);
+}
+
+void vTaskDelay(portTickType ticks) {
+    struct timespec ts;
+    uint64_t ns = (uint64_t)ticks * portTICK_RATE_MS * 1000000ULL;
+    ts.tv_sec = ns / 1000000000ULL;
+    ts.tv_nsec = ns % 1000000000ULL;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+}
+
+portTickType xTaskGetTickCount(void) {
+    static struct timespec start = { 0, 0 };
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((start.tv_sec == 0) && (start.tv_nsec == 0)) {
+        start = now;
+    }
+
+    uint64_t ms = (now.tv_sec - start.tv_sec) * 1000ULL + (now.tv_nsec - start.tv_nsec) / 1000000LL;
+    return ms / portTICK_RATE_MS;
+}
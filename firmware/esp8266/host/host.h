@@ -0,0 +1,12 @@
+#ifndef host_host_h_included
+#define host_host_h_included
+
+#include <esp_common.h>
+
+// deliver a wifi event to the handler registered by the lamp
+void host_send_wifi_event(System_Event_t *event);
+
+// print the send and recv counts on SIGUSR1 (see syscalls.c)
+void host_count_syscalls(void);
+
+#endif /* host_host_h_included */
@@ -0,0 +1,24 @@
+#ifndef host_c_types_h_included
+#define host_c_types_h_included
+
+//
+// Host replacement for the ESP8266 SDK c_types.h
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint8_t uint8;
+typedef int8_t sint8;
+typedef uint16_t uint16;
+typedef int16_t sint16;
+typedef uint32_t uint32;
+typedef int32_t sint32;
+
+// there is no flash mapped rodata on the host, everything is plain memory
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RODATA_ATTR
+#define STORE_ATTR __attribute__((aligned(4)))
+
+#endif /* host_c_types_h_included */
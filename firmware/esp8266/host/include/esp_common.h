@@ -0,0 +1,97 @@
+#ifndef host_esp_common_h_included
+#define host_esp_common_h_included
+
+//
+// Host replacement for the parts of the ESP8266 RTOS SDK used by the lamp
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "c_types.h"
+#include "ip_addr.h"
+
+#define os_printf printf
+#define zalloc(_size) calloc(1, (_size))
+
+typedef enum {
+    FLASH_SIZE_4M_MAP_256_256 = 0,
+    FLASH_SIZE_2M,
+    FLASH_SIZE_8M_MAP_512_512,
+    FLASH_SIZE_16M_MAP_512_512,
+    FLASH_SIZE_32M_MAP_512_512,
+    FLASH_SIZE_16M_MAP_1024_1024,
+    FLASH_SIZE_32M_MAP_1024_1024,
+    FLASH_SIZE_64M_MAP_1024_1024,
+    FLASH_SIZE_128M_MAP_1024_1024
+} flash_size_map;
+
+typedef enum {
+    EVENT_STAMODE_CONNECTED = 0,
+    EVENT_STAMODE_DISCONNECTED,
+    EVENT_STAMODE_AUTHMODE_CHANGE,
+    EVENT_STAMODE_GOT_IP,
+    EVENT_STAMODE_DHCP_TIMEOUT,
+    EVENT_MAX
+} SYSTEM_EVENT;
+
+typedef struct {
+    struct ip_addr ip;
+    struct ip_addr mask;
+    struct ip_addr gw;
+} Event_StaMode_Got_IP_t;
+
+typedef union {
+    Event_StaMode_Got_IP_t got_ip;
+} Event_Info_u;
+
+typedef struct _esp_event {
+    SYSTEM_EVENT event_id;
+    Event_Info_u event_info;
+} System_Event_t;
+
+typedef void (*wifi_event_handler_cb_t)(System_Event_t *event);
+
+// register the wifi event handler, the host build calls it with
+// EVENT_STAMODE_GOT_IP right after `user_init` returns
+bool wifi_set_event_handler_cb(wifi_event_handler_cb_t cb);
+
+const char *system_get_sdk_version(void);
+flash_size_map system_get_flash_size_map(void);
+uint32 system_get_free_heap_size(void);
+
+// microseconds since start, wraps every 71 minutes like on the device
+uint32 system_get_time(void);
+
+//
+// SPI flash and firmware upgrade, emulated with a file by `flash.c`
+//
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+    SPI_FLASH_RESULT_OK,
+    SPI_FLASH_RESULT_ERR,
+    SPI_FLASH_RESULT_TIMEOUT
+} SpiFlashOpResult;
+
+SpiFlashOpResult spi_flash_erase_sector(uint16 sec);
+SpiFlashOpResult spi_flash_write(uint32 des_addr, uint32 *src_addr, uint32 size);
+SpiFlashOpResult spi_flash_read(uint32 src_addr, uint32 *des_addr, uint32 size);
+
+#define UPGRADE_FLAG_IDLE   0x00
+#define UPGRADE_FLAG_START  0x01
+#define UPGRADE_FLAG_FINISH 0x02
+
+#define UPGRADE_FW_BIN1 0x00
+#define UPGRADE_FW_BIN2 0x01
+
+void system_upgrade_flag_set(uint8 flag);
+uint8 system_upgrade_flag_check(void);
+uint8 system_upgrade_userbin_check(void);
+
+// the host does not restart, it switches the running user bin and goes on
+void system_upgrade_reboot(void);
+
+#endif /* host_esp_common_h_included */
@@ -0,0 +1,24 @@
+#ifndef host_freertos_h_included
+#define host_freertos_h_included
+
+//
+// Minimal FreeRTOS shim for the host build, backed by pthreads.
+// Only the subset of the API used by shttp, mdns and the lamp is provided.
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef long portBASE_TYPE;
+typedef unsigned long portTickType;
+
+#define pdTRUE  ((portBASE_TYPE)1)
+#define pdFALSE ((portBASE_TYPE)0)
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+// same tick rate as the ESP8266 RTOS SDK (100 Hz)
+#define portTICK_RATE_MS ((portTickType)10)
+#define portMAX_DELAY ((portTickType)0xffffffffUL)
+
+#endif /* host_freertos_h_included */
@@ -0,0 +1,28 @@
+#ifndef host_freertos_queue_h_included
+#define host_freertos_queue_h_included
+
+#include "FreeRTOS.h"
+
+typedef struct _hostQueue *xQueueHandle;
+
+// create a queue of `length` items of `itemSize` bytes each
+xQueueHandle xQueueCreate(unsigned long length, unsigned long itemSize);
+
+// destroy a queue, no task may be blocked on it
+void vQueueDelete(xQueueHandle queue);
+
+// append an item, blocks up to `ticksToWait` if the queue is full
+portBASE_TYPE xQueueSendToBack(xQueueHandle queue, const void *item, portTickType ticksToWait);
+
+// fetch and remove the first item, blocks up to `ticksToWait` if the queue is empty
+portBASE_TYPE xQueueReceive(xQueueHandle queue, void *item, portTickType ticksToWait);
+
+// fetch the first item without removing it
+portBASE_TYPE xQueuePeek(xQueueHandle queue, void *item, portTickType ticksToWait);
+
+// number of items waiting in the queue
+unsigned long uxQueueMessagesWaiting(xQueueHandle queue);
+
+#define xQueueSend xQueueSendToBack
+
+#endif /* host_freertos_queue_h_included */
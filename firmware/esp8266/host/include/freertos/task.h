@@ -0,0 +1,25 @@
+#ifndef host_freertos_task_h_included
+#define host_freertos_task_h_included
+
+#include <sched.h>
+
+#include "FreeRTOS.h"
+
+typedef struct _hostTask *xTaskHandle;
+typedef void (pdTASK_CODE)(void *userData);
+
+// start a task as a detached pthread, stack depth and priority are ignored
+portBASE_TYPE xTaskCreate(pdTASK_CODE *code, const char *name, unsigned short stackDepth, void *userData, unsigned long priority, xTaskHandle *handle);
+
+// stop a task, pass NULL to stop the calling task
+void vTaskDelete(xTaskHandle task);
+
+// sleep for the number of ticks
+void vTaskDelay(portTickType ticks);
+
+// current tick count since startup
+portTickType xTaskGetTickCount(void);
+
+#define taskYIELD() sched_yield()
+
+#endif /* host_freertos_task_h_included */
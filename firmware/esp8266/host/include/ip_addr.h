@@ -0,0 +1,12 @@
+#ifndef host_ip_addr_h_included
+#define host_ip_addr_h_included
+
+#include <stdint.h>
+
+// lwIP IPv4 address, network byte order
+struct ip_addr {
+    uint32_t addr;
+};
+typedef struct ip_addr ip_addr_t;
+
+#endif /* host_ip_addr_h_included */
@@ -0,0 +1,489 @@
+//
+// Simple HTTP load generator for the host build of the lamp firmware
+//
+// Usage: loadgen [-H host] [-p port] [-c clients] [-n requests] [-m method] [-b body] [-h header] [-k] [-s scenario] [-j] path
+//
+// Every client runs in its own thread and issues `requests` requests
+// sequentially, each on a fresh connection or with `-k` re-using the
+// connection as long as the server keeps it open. `-h` adds a request
+// header (e.g. -h 'Accept-Encoding: gzip') and may be given repeatedly. Prints throughput and
+// latency percentiles when all clients are done, with `-j` as one line of JSON.
+//
+// Instead of a path a scenario replays what the web UI does, `-n` is the
+// number of repetitions per client then and connections are kept alive:
+// - `page`: a page load, the HTML, all assets and the current parameters
+// - `slider`: a burst of POSTs to /parameters like dragging a slider
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// one request of an iteration
+typedef struct _loadRequest {
+    const char *method;
+    const char *path;
+    const char *headers;
+    char body[64];
+} loadRequest;
+
+// requests of one repetition of a scenario
+typedef struct _loadScenario {
+    const char *name;
+    loadRequest *requests;
+    uint32_t numRequests;
+} loadScenario;
+
+typedef struct _loadConfig {
+    char *host;
+    char *port;
+    char *method;
+    char *path;
+    char *body;
+    char headers[1024];
+    uint32_t clients;
+    uint32_t requests;
+    bool keepAlive;
+    loadScenario *scenario; // NULL to send `path` only
+    bool json;
+} loadConfig;
+
+// what a browser fetches for the web UI
+static loadRequest pageRequests[] = {
+    { "GET", "/", "Accept-Encoding: gzip, deflate\r\n", "" },
+    { "GET", "/main.css", "Accept-Encoding: gzip, deflate\r\n", "" },
+    { "GET", "/main.js", "Accept-Encoding: gzip, deflate\r\n", "" },
+    { "GET", "/colorwheel.jpg", "Accept-Encoding: gzip, deflate\r\n", "" },
+    { "GET", "/hexagon.png", "Accept-Encoding: gzip, deflate\r\n", "" },
+    { "GET", "/favicon.ico", "Accept-Encoding: gzip, deflate\r\n", "" },
+    { "GET", "/parameters", "", "" },
+};
+
+// one slider drag sends an update for every step the slider moves
+#define SLIDER_STEPS 20
+static loadRequest sliderRequests[SLIDER_STEPS];
+
+typedef struct _loadClient {
+    loadConfig *config;
+    pthread_t thread;
+
+    uint64_t *latencies; // nanoseconds, one per successful request
+    uint32_t completed;
+    uint32_t errors;
+    uint64_t bytesReceived;
+    uint32_t connections;
+} loadClient;
+
+static struct addrinfo *serverAddress;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_to_server(void) {
+    int sock = socket(serverAddress->ai_family, serverAddress->ai_socktype, serverAddress->ai_protocol);
+    if (sock < 0) {
+        return -1;
+    }
+
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    if (connect(sock, serverAddress->ai_addr, serverAddress->ai_addrlen) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// chunked transfer encoding decoder, only tracks where the body ends
+typedef struct _chunkState {
+    int64_t remaining;  // data bytes left in the current chunk, -1 while reading a size line
+    int64_t size;       // size line being read
+    uint8_t skip;       // line break bytes to skip after the data
+    bool last;          // zero sized chunk seen, reading the trailer
+    bool lineEmpty;     // current trailer line is empty so far
+} chunkState;
+
+// feed body bytes, returns true when the body is complete
+static bool chunk_feed(chunkState *state, const char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = data[i];
+        if (state->skip > 0) {
+            state->skip--;
+        } else if (state->last) {
+            // trailer lines up to an empty one
+            if (c == '\n') {
+                if (state->lineEmpty) {
+                    return true;
+                }
+                state->lineEmpty = true;
+            } else if (c != '\r') {
+                state->lineEmpty = false;
+            }
+        } else if (state->remaining < 0) {
+            if (c == '\n') {
+                if (state->size == 0) {
+                    state->last = true;
+                    state->lineEmpty = true;
+                } else {
+                    state->remaining = state->size;
+                }
+            } else if ((c >= '0') && (c <= '9')) {
+                state->size = state->size * 16 + (c - '0');
+            } else if ((c >= 'a') && (c <= 'f')) {
+                state->size = state->size * 16 + (c - 'a' + 10);
+            } else if ((c >= 'A') && (c <= 'F')) {
+                state->size = state->size * 16 + (c - 'A' + 10);
+            }
+        } else {
+            // chunk data, skip as much as is there
+            size_t n = len - i;
+            if ((int64_t)n > state->remaining) {
+                n = state->remaining;
+            }
+            state->remaining -= n;
+            i += n - 1;
+            if (state->remaining == 0) {
+                state->remaining = -1;
+                state->size = 0;
+                state->skip = 2;
+            }
+        }
+    }
+    return false;
+}
+
+// reads one response, returns number of bytes or -1 on error,
+// `closed` is set if the server ended the connection
+static int64_t read_response(int sock, char *buffer, size_t size, bool *closed) {
+    size_t used = 0;
+    int64_t headerEnd = -1;
+    int64_t contentLength = -1;
+    int64_t total = 0;
+    bool chunked = false;
+    chunkState chunks = { -1, 0, 0, false, false };
+
+    *closed = false;
+    while (1) {
+        ssize_t result = recv(sock, buffer + used, size - used - 1, 0);
+        if (result < 0) {
+            return -1;
+        }
+        if (result == 0) {
+            // connection closed, that finishes responses without length
+            *closed = true;
+            return (headerEnd >= 0) ? total : -1;
+        }
+        total += result;
+
+        if (headerEnd < 0) {
+            used += result;
+            buffer[used] = '\0';
+
+            char *end = strstr(buffer, "\r\n\r\n");
+            if (end == NULL) {
+                if (used >= size - 1) {
+                    return -1; // header block too big
+                }
+                continue;
+            }
+            headerEnd = (end - buffer) + 4;
+
+            if (strncmp(buffer, "HTTP/1.1 ", 9) != 0) {
+                return -1;
+            }
+
+            // these never have a body
+            if ((strncmp(buffer + 9, "204", 3) == 0) || (strncmp(buffer + 9, "304", 3) == 0)) {
+                contentLength = 0;
+            }
+
+            for (char *line = strstr(buffer, "\r\n"); (line != NULL) && (line < end); line = strstr(line + 2, "\r\n")) {
+                if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+                    contentLength = strtoll(line + 17, NULL, 10);
+                }
+                if (strncasecmp(line + 2, "Connection: close", 17) == 0) {
+                    *closed = true;
+                }
+                if (strncasecmp(line + 2, "Transfer-Encoding: chunked", 26) == 0) {
+                    chunked = true;
+                }
+            }
+
+            // body bytes that came with the headers
+            if ((chunked) && (chunk_feed(&chunks, buffer + headerEnd, used - headerEnd))) {
+                return total;
+            }
+            used = 0;
+        } else if ((chunked) && (chunk_feed(&chunks, buffer, result))) {
+            return total;
+        }
+
+        if ((contentLength >= 0) && (total >= headerEnd + contentLength)) {
+            return total;
+        }
+    }
+}
+
+static loadScenario scenarios[] = {
+    { "page", pageRequests, sizeof(pageRequests) / sizeof(loadRequest) },
+    { "slider", sliderRequests, SLIDER_STEPS },
+    { NULL, NULL, 0 }
+};
+
+static void build_slider_requests(void) {
+    for (uint32_t i = 0; i < SLIDER_STEPS; i++) {
+        sliderRequests[i] = (loadRequest){ "POST", "/parameters", "Content-Type: application/json\r\n", "" };
+        snprintf(sliderRequests[i].body, sizeof(sliderRequests[i].body), "{\"brightness\":%.2f}", (double)i / (SLIDER_STEPS - 1));
+    }
+}
+
+// serialize a request, the result has to be freed
+static char *build_request(loadConfig *config, const char *method, const char *path, const char *headers, const char *body, int *len) {
+    size_t bodyLen = (body) ? strlen(body) : 0;
+    char *request = malloc(512 + strlen(path) + sizeof(config->headers) + strlen(headers) + bodyLen);
+    *len = sprintf(request,
+        "%s %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "%s"
+        "%s"
+        "%s"
+        "\r\n"
+        "%s",
+        method, path, config->host, bodyLen,
+        config->headers, headers,
+        (config->keepAlive) ? "" : "Connection: close\r\n",
+        (body) ? body : "");
+    return request;
+}
+
+static void *client_thread(void *userData) {
+    loadClient *client = userData;
+    loadConfig *config = client->config;
+
+    // build the requests once
+    loadScenario *scenario = config->scenario;
+    uint32_t numRequests = (scenario != NULL) ? scenario->numRequests : 1;
+    char **requests = malloc(numRequests * sizeof(char *));
+    int *requestLens = malloc(numRequests * sizeof(int));
+    for (uint32_t i = 0; i < numRequests; i++) {
+        if (scenario != NULL) {
+            loadRequest *r = &scenario->requests[i];
+            requests[i] = build_request(config, r->method, r->path, r->headers, r->body, &requestLens[i]);
+        } else {
+            requests[i] = build_request(config, config->method, config->path, "", config->body, &requestLens[i]);
+        }
+    }
+
+    char *buffer = malloc(4096);
+    int sock = -1;
+    for (uint32_t i = 0; i < config->requests * numRequests; i++) {
+        char *request = requests[i % numRequests];
+        int requestLen = requestLens[i % numRequests];
+        uint64_t start = now_ns();
+
+        if (sock < 0) {
+            sock = connect_to_server();
+            if (sock < 0) {
+                client->errors++;
+                continue;
+            }
+            client->connections++;
+        }
+
+        if (send(sock, request, requestLen, 0) != requestLen) {
+            client->errors++;
+            close(sock);
+            sock = -1;
+            continue;
+        }
+
+        bool closed;
+        int64_t bytes = read_response(sock, buffer, 4096, &closed);
+        if ((bytes < 0) || closed || !config->keepAlive) {
+            close(sock);
+            sock = -1;
+        }
+        if (bytes < 0) {
+            client->errors++;
+            continue;
+        }
+
+        client->latencies[client->completed++] = now_ns() - start;
+        client->bytesReceived += bytes;
+    }
+    if (sock >= 0) {
+        close(sock);
+    }
+
+    free(buffer);
+    for (uint32_t i = 0; i < numRequests; i++) {
+        free(requests[i]);
+    }
+    free(requests);
+    free(requestLens);
+    return NULL;
+}
+
+static int compare_latency(const void *a, const void *b) {
+    uint64_t l = *(const uint64_t *)a;
+    uint64_t r = *(const uint64_t *)b;
+    return (l > r) - (l < r);
+}
+
+static double percentile_ms(uint64_t *sorted, uint32_t count, double p) {
+    if (count == 0) {
+        return 0.0;
+    }
+    uint32_t index = (uint32_t)(p / 100.0 * (count - 1) + 0.5);
+    return sorted[index] / 1000000.0;
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c clients] [-n requests per client] [-m method] [-b body] [-h header] [-k] [-s page|slider] [-j] path\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    loadConfig config = {
+        .host = "127.0.0.1",
+        .port = "8080",
+        .method = "GET",
+        .path = "/",
+        .body = NULL,
+        .headers = "",
+        .clients = 4,
+        .requests = 1000,
+        .keepAlive = false,
+        .scenario = NULL,
+        .json = false
+    };
+
+    char *scenarioName = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:n:m:b:h:ks:j")) != -1) {
+        switch (opt) {
+            case 'H': config.host = optarg; break;
+            case 'p': config.port = optarg; break;
+            case 'c': config.clients = atoi(optarg); break;
+            case 'n': config.requests = atoi(optarg); break;
+            case 'm': config.method = optarg; break;
+            case 'b': config.body = optarg; break;
+            case 'h':
+                if (strlen(config.headers) + strlen(optarg) + 3 > sizeof(config.headers)) {
+                    usage(argv[0]);
+                }
+                strcat(config.headers, optarg);
+                strcat(config.headers, "\r\n");
+                break;
+            case 'k': config.keepAlive = true; break;
+            case 's': scenarioName = optarg; break;
+            case 'j': config.json = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind < argc) {
+        config.path = argv[optind];
+    }
+    if ((config.clients == 0) || (config.requests == 0)) {
+        usage(argv[0]);
+    }
+
+    // scenarios behave like a browser, which keeps its connections
+    uint32_t numRequests = 1;
+    if (scenarioName != NULL) {
+        build_slider_requests();
+        for (loadScenario *s = scenarios; s->name != NULL; s++) {
+            if (strcmp(s->name, scenarioName) == 0) {
+                config.scenario = s;
+            }
+        }
+        if (config.scenario == NULL) {
+            usage(argv[0]);
+        }
+        numRequests = config.scenario->numRequests;
+        config.keepAlive = true;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(config.host, config.port, &hints, &serverAddress) != 0) {
+        fprintf(stderr, "Could not resolve %s:%s\n", config.host, config.port);
+        return 1;
+    }
+
+    loadClient *clients = calloc(config.clients, sizeof(loadClient));
+    uint64_t start = now_ns();
+    for (uint32_t i = 0; i < config.clients; i++) {
+        clients[i].config = &config;
+        clients[i].latencies = malloc(config.requests * numRequests * sizeof(uint64_t));
+        pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+    }
+
+    // collect results
+    uint64_t *latencies = malloc((uint64_t)config.clients * config.requests * numRequests * sizeof(uint64_t));
+    uint32_t completed = 0, errors = 0, connections = 0;
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < config.clients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        memcpy(latencies + completed, clients[i].latencies, clients[i].completed * sizeof(uint64_t));
+        completed += clients[i].completed;
+        errors += clients[i].errors;
+        bytes += clients[i].bytesReceived;
+        connections += clients[i].connections;
+        free(clients[i].latencies);
+    }
+    double elapsed = (now_ns() - start) / 1000000000.0;
+
+    qsort(latencies, completed, sizeof(uint64_t), compare_latency);
+
+    if (config.json) {
+        printf("{\"name\":\"%s\",\"clients\":%u,\"requests\":%u,\"completed\":%u,\"errors\":%u,\"connections\":%u,"
+            "\"elapsed_s\":%.3f,\"requests_per_s\":%.1f,\"kib_per_s\":%.1f,"
+            "\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}\n",
+            (config.scenario != NULL) ? config.scenario->name : config.path,
+            config.clients, config.requests * numRequests, completed, errors, connections,
+            elapsed, completed / elapsed, bytes / 1024.0 / elapsed,
+            percentile_ms(latencies, completed, 50.0), percentile_ms(latencies, completed, 90.0),
+            percentile_ms(latencies, completed, 99.0), percentile_ms(latencies, completed, 100.0));
+    } else {
+        if (config.scenario != NULL) {
+            printf("%s scenario (%u clients x %u repetitions x %u requests)\n", config.scenario->name, config.clients, config.requests, numRequests);
+        } else {
+            printf("%s %s (%u clients x %u requests)\n", config.method, config.path, config.clients, config.requests);
+        }
+        printf("  completed:    %u\n", completed);
+        printf("  errors:       %u\n", errors);
+        printf("  connections:  %u\n", connections);
+        printf("  elapsed:      %.3f s\n", elapsed);
+        printf("  requests/sec: %.1f\n", completed / elapsed);
+        printf("  transfer:     %.1f KiB/s\n", bytes / 1024.0 / elapsed);
+        printf("  latency p50:  %.3f ms\n", percentile_ms(latencies, completed, 50.0));
+        printf("  latency p90:  %.3f ms\n", percentile_ms(latencies, completed, 90.0));
+        printf("  latency p99:  %.3f ms\n", percentile_ms(latencies, completed, 99.0));
+        printf("  latency max:  %.3f ms\n", percentile_ms(latencies, completed, 100.0));
+    }
+
+    free(latencies);
+    free(clients);
+    freeaddrinfo(serverAddress);
+    return (errors > 0) ? 2 : 0;
+}
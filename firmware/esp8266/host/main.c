@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <signal.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "host.h"
+
+// implemented in lamp/user_main.c
+void user_init(void);
+
+int main(int argc, char **argv) {
+    // lwIP has no signals, a client hanging up must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    host_count_syscalls();
+
+    user_init();
+
+    // pretend DHCP finished, this starts the HTTP server and mdns
+    System_Event_t event;
+    memset(&event, 0, sizeof(event));
+    event.event_id = EVENT_STAMODE_GOT_IP;
+    event.event_info.got_ip.ip.addr = htonl(INADDR_LOOPBACK);
+    host_send_wifi_event(&event);
+
+    // everything runs in tasks from now on
+    pthread_exit(NULL);
+}
@@ -0,0 +1,34 @@
+#ifndef mdns_platform_h_included
+#define mdns_platform_h_included
+
+//
+// Host replacement for the lwIP based mdns platform layer
+//
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <ip_addr.h>
+#include <mdns/mdns.h>
+
+// packets are not sent anywhere on the host, the handle just counts them
+typedef struct _mdnsUDPHandle {
+    uint32_t packetsSent;
+    uint32_t bytesSent;
+} mdnsUDPHandle;
+
+// received packets are flat buffers instead of pbuf chains
+typedef struct _mdnsNetworkBuffer {
+    uint8_t *payload;
+    uint16_t len;
+} mdnsNetworkBuffer;
+
+struct _mdnsStreamBuf {
+    mdnsNetworkBuffer *buffer;
+    uint16_t currentPosition;
+};
+
+#endif /* mdns_platform_h_included */
@@ -0,0 +1,42 @@
+#include "platform.h"
+
+#include "mdns_network.h"
+#include "stream.h"
+#include "debug.h"
+#include "server.h"
+
+//
+// API
+//
+
+bool mdns_join_multicast_group(void) {
+    LOG(TRACE, "mdns: joining multicast group (host: no-op)");
+    return true;
+}
+
+bool mdns_leave_multicast_group(void) {
+    LOG(TRACE, "mdns: leaving multicast group (host: no-op)");
+    return true;
+}
+
+mdnsUDPHandle *mdns_listen(mdnsHandle *handle) {
+    LOG(TRACE, "mdns: listening on MDNS port (host: no-op)");
+    return calloc(1, sizeof(mdnsUDPHandle));
+}
+
+uint16_t mdns_send_udp_packet(mdnsHandle *handle, char *data, uint16_t len) {
+    if (handle->pcb != NULL) {
+        handle->pcb->packetsSent++;
+        handle->pcb->bytesSent += len;
+    }
+
+    LOG(TRACE, "mdns: dropping packet (%d bytes)", len);
+
+    free(data);
+    return len;
+}
+
+void mdns_shutdown_socket(mdnsUDPHandle *pcb) {
+    LOG(TRACE, "mdns: shutting down socket");
+    free(pcb);
+}
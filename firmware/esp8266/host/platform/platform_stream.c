@@ -0,0 +1,30 @@
+#include "platform.h"
+
+#include "stream.h"
+#include "debug.h"
+
+//
+// API
+//
+
+// create stream reader
+mdnsStreamBuf *mdns_stream_new(mdnsNetworkBuffer *buffer) {
+    mdnsStreamBuf *buf = malloc(sizeof(mdnsStreamBuf));
+
+    buf->buffer = buffer;
+    buf->currentPosition = 0;
+    return buf;
+}
+
+// read byte from stream, reads past the end return zero
+uint8_t mdns_stream_read8(mdnsStreamBuf *buffer) {
+    if (buffer->currentPosition >= buffer->buffer->len) {
+        return 0;
+    }
+    return buffer->buffer->payload[buffer->currentPosition++];
+}
+
+// destroy stream reader
+void mdns_stream_destroy(mdnsStreamBuf *buffer) {
+    free(buffer);
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "host.h"
+
+//
+// Socket call counters. The host build links with `--wrap=send` and
+// `--wrap=recv`, so every call of the server ends up here first. Each
+// send is a TCP segment of its own on the device (TCP_NODELAY) and a pbuf
+// allocation in lwIP, so fewer calls per response are what counts.
+//
+// `kill -USR1 <pid>` prints the counts since the last signal to stderr
+// and starts over.
+//
+
+typedef struct _hostSocketCounter {
+    uint32 calls;
+    uint64_t bytes;
+} hostSocketCounter;
+
+static hostSocketCounter sendCounter;
+static hostSocketCounter recvCounter;
+
+ssize_t __real_send(int socket, const void *data, size_t len, int flags);
+ssize_t __real_recv(int socket, void *buffer, size_t len, int flags);
+
+static void host_count(hostSocketCounter *counter, ssize_t result) {
+    __atomic_add_fetch(&counter->calls, 1, __ATOMIC_RELAXED);
+    if (result > 0) {
+        __atomic_add_fetch(&counter->bytes, (uint64_t)result, __ATOMIC_RELAXED);
+    }
+}
+
+ssize_t __wrap_send(int socket, const void *data, size_t len, int flags) {
+    ssize_t result = __real_send(socket, data, len, flags);
+    host_count(&sendCounter, result);
+    return result;
+}
+
+ssize_t __wrap_recv(int socket, void *buffer, size_t len, int flags) {
+    ssize_t result = __real_recv(socket, buffer, len, flags);
+    host_count(&recvCounter, result);
+    return result;
+}
+
+static void host_print_counters(int signal) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "send: %u calls, %llu bytes\nrecv: %u calls, %llu bytes\n",
+        __atomic_exchange_n(&sendCounter.calls, 0, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_exchange_n(&sendCounter.bytes, 0, __ATOMIC_RELAXED),
+        __atomic_exchange_n(&recvCounter.calls, 0, __ATOMIC_RELAXED),
+        (unsigned long long)__atomic_exchange_n(&recvCounter.bytes, 0, __ATOMIC_RELAXED));
+
+    // write is safe in a signal handler, stdio is not
+    if (write(STDERR_FILENO, line, len) < 0) {
+        return;
+    }
+}
+
+void host_count_syscalls(void) {
+    signal(SIGUSR1, host_print_counters);
+}
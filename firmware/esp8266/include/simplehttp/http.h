@@ -5,7 +5,8 @@
 // You may override the following parameters to customize memory usage
 //
 
-// Data processing task stack size
+// Data processing task stack size, the task calling shttp_listen needs
+// the same
 #ifndef SHTTP_STACK_SIZE
 #define SHTTP_STACK_SIZE 1000
 #endif
@@ -15,24 +16,128 @@
 #define SHTTP_PRIO 3
 #endif
 
-// Max HTTP recv buffer
+// Number of data processing tasks, every worker handles one connection
+// at a time and costs one task stack plus SHTTP_MAX_RECV_BUFFER bytes
+#ifndef SHTTP_WORKERS
+#define SHTTP_WORKERS 2
+#endif
+
+// Idle persistent connections give up their worker while other
+// connections wait for one, they are parked: the task calling shttp_listen
+// watches them until their next request arrives. WebSockets are parked
+// whenever they wait for a frame. Workers look this often (in
+// milliseconds) for waiting connections, the parked ones are picked up as
+// often
+#ifndef SHTTP_PARK_INTERVAL
+#define SHTTP_PARK_INTERVAL 50
+#endif
+
+// Max number of parked connections, idle ones beyond this are closed.
+// WebSockets push idle persistent connections out
+#ifndef SHTTP_MAX_PARKED_CONNECTIONS
+#define SHTTP_MAX_PARKED_CONNECTIONS 8
+#endif
+
+// Set to 1 to serve all connections from the task calling shttp_listen
+// with a select() loop instead of starting SHTTP_WORKERS tasks
+#ifndef SHTTP_EVENT_LOOP
+#define SHTTP_EVENT_LOOP 0
+#endif
+
+// Max number of connections served at once in event loop mode, keep
+// this below the number of sockets lwIP provides (MEMP_NUM_NETCONN)
+#ifndef SHTTP_MAX_CONNECTIONS
+#define SHTTP_MAX_CONNECTIONS 4
+#endif
+
+// Max number of open WebSockets, more opening handshakes are answered with
+// 503. Keep this below SHTTP_MAX_CONNECTIONS in event loop mode, where
+// each one holds a connection slot, and at most SHTTP_MAX_PARKED_CONNECTIONS
+#ifndef SHTTP_MAX_WEBSOCKETS
+#define SHTTP_MAX_WEBSOCKETS 3
+#endif
+
+// Size of the per connection request buffer, requests are parsed in
+// place so this should fit a typical request including its headers
 #ifndef SHTTP_MAX_RECV_BUFFER
 #define SHTTP_MAX_RECV_BUFFER 1500 /* default max MTU */
 #endif
 
-// Max HTTP body size
+// Max HTTP body size, also limits the size of the header block. The
+// request buffer grows up to this for big requests
 #ifndef SHTTP_MAX_BODY_SIZE
 #define SHTTP_MAX_BODY_SIZE 4096
 #endif
 
+// Max number of headers, URL parameters and URL path parameters kept
+// per request, additional ones are ignored
+#ifndef SHTTP_MAX_HEADERS
+#define SHTTP_MAX_HEADERS 16
+#endif
+
+#ifndef SHTTP_MAX_PARAMETERS
+#define SHTTP_MAX_PARAMETERS 8
+#endif
+
+#ifndef SHTTP_MAX_PATH_PARAMETERS
+#define SHTTP_MAX_PATH_PARAMETERS 4
+#endif
+
+// Size of the per connection arena route callbacks can allocate request
+// lifetime memory from (see shttp_request_alloc). It is allocated on first
+// use only.
+#ifndef SHTTP_ARENA_SIZE
+#define SHTTP_ARENA_SIZE 512
+#endif
+
+// Idle timeout for client connections in milliseconds, a connection
+// that does not send anything for this long is closed (parked or not)
+#ifndef SHTTP_IDLE_TIMEOUT
+#define SHTTP_IDLE_TIMEOUT 5000
+#endif
+
+// Max number of requests served on one persistent (keep-alive)
+// connection before it is closed, set to 1 to disable keep-alive
+#ifndef SHTTP_KEEPALIVE_MAX_REQUESTS
+#define SHTTP_KEEPALIVE_MAX_REQUESTS 16
+#endif
+
 // simplehttp can accept multiple connections at once but only
-// processes them in incoming order, one at a time. This defined
-// how many connections may be queued before just dropping the
+// processes SHTTP_WORKERS of them at a time, in incoming order. This
+// defines how many connections may be queued before just dropping the
 // connection
 #ifndef SHTTP_MAX_QUEUED_CONNECTIONS
 #define SHTTP_MAX_QUEUED_CONNECTIONS 10
 #endif
 
+// Status line and headers of a response are serialized into one buffer
+// and sent with a single write, bodies that fit in are sent along. The
+// buffer lives on the stack of the serving task, bigger header blocks
+// are allocated
+#ifndef SHTTP_RESPONSE_BUFFER
+#define SHTTP_RESPONSE_BUFFER 256
+#endif
+
+// Static bodies and prebuilt header blocks (see shttpResponse.staticBody)
+// are copied through a word aligned buffer of this size and sent with one
+// send() per chunk, one TCP segment (MSS) by default. There is one buffer
+// per worker (one in event loop mode), allocated statically and not on
+// the task stack. Keep it a multiple of 4
+#ifndef SHTTP_STATIC_CHUNK
+#define SHTTP_STATIC_CHUNK 1460
+#endif
+
+// Max number of clients subscribed to one event stream at a time
+#ifndef SHTTP_MAX_EVENT_CLIENTS
+#define SHTTP_MAX_EVENT_CLIENTS 4
+#endif
+
+// Collect per route request counters, latency histograms and connection
+// and heap gauges, see shttp_metrics_route. Costs about 160 bytes per route
+#ifndef SHTTP_METRICS
+#define SHTTP_METRICS 1
+#endif
+
 // enable CJSON support
 #ifndef SHTTP_CJSON
 #define SHTTP_CJSON 1
@@ -67,13 +172,39 @@ typedef shttpKeyValue shttpHeader;
 // a HTTP URL parameter
 typedef shttpKeyValue shttpParameter;
 
+// headers the parser recognizes, their values are found without searching
+// with shttp_request_header
+typedef enum _shttpKnownHeader {
+    SHTTP_HDR_HOST = 0,
+    SHTTP_HDR_CONTENT_LENGTH,
+    SHTTP_HDR_CONTENT_TYPE,
+    SHTTP_HDR_ACCEPT_ENCODING,
+    SHTTP_HDR_IF_NONE_MATCH,
+    SHTTP_HDR_CONNECTION,
+    SHTTP_HDR_UPGRADE,
+    SHTTP_HDR_ACCEPT,
+    SHTTP_HDR_SEC_WEBSOCKET_KEY,
+    SHTTP_HDR_SEC_WEBSOCKET_VERSION,
+
+    SHTTP_HDR_COUNT
+} shttpKnownHeader;
+
+// cleanup callback, called to clean up user data pointer
+typedef void *(shttpCleanupCallback)(void *userData);
+
 // HTTP request data
+// All strings point into the connection buffer, they are zero terminated
+// but only valid until the route callback returns. Copy what you need.
 typedef struct _shttpRequest {
-    // headers on the HTTP request
+    // headers on the HTTP request, names are lower case
     shttpHeader *headers;
     // number of headers
     uint8_t numHeaders;
 
+    // values of the known headers, NULL if the request did not send them.
+    // They are set even if there are more than SHTTP_MAX_HEADERS headers
+    char *knownHeaders[SHTTP_HDR_COUNT];
+
     // URL parameters (those after a ?)
     shttpParameter *parameters;
     // number of parameters
@@ -84,13 +215,32 @@ typedef struct _shttpRequest {
     // number of parameters
     uint8_t numPathParameters;
 
-    // request body
+    // request body, zero terminated
+    // empty for streaming routes, their body callback got the data
     char *bodyData;
     uint16_t bodyLen;
+
+    // declared body size (Content-Length)
+    uint32_t contentLength;
+    // bytes of the body already passed to the body callback of a
+    // streaming route, zero on the first part
+    uint32_t bodyReceived;
+
+    // request lifetime memory, use shttp_request_alloc
+    struct _shttpArena *arena;
+
+    // free for the route callbacks, NULL when the request starts. If
+    // `cleanupCallback` is set it is called with `userData` once the
+    // request is done, answered or not (e.g. the client went away in the
+    // middle of the body of a streaming route)
+    void *userData;
+    shttpCleanupCallback *cleanupCallback;
 } shttpRequest;
 
 // HTTP status code to make code more readable
 typedef enum _shttpStatusCode {
+    shttpStatusSwitchingProtocols = 101,
+
     shttpStatusOK = 200,
     shttpStatusCreated = 201,
     shttpStatusAccepted = 202,
@@ -104,9 +254,13 @@ typedef enum _shttpStatusCode {
     shttpStatusUnauthorized = 401,
     shttpStatusForbidden = 403,
     shttpStatusNotFound = 404,
+    shttpStatusNotAllowed = 405,
     shttpStatusNotAcceptable = 406,
     shttpStatusConflict = 409,
+    shttpStatusPayloadTooLarge = 413,
     shttpStatusRequestURITooLong = 414,
+    shttpStatusMisdirectedRequest = 421,
+    shttpStatusUpgradeRequired = 426,
 
     shttpStatusInternalError = 500,
     shttpStatusNotImplemented = 501,
@@ -119,11 +273,32 @@ typedef enum _shttpStatusCode {
 // - the number of bytes already sent
 // - output parameter (length of the chunk returned)
 // - user data pointer from above
-// returns char pointer with new data or NULL to finish the request (closes the connection)
+// returns char pointer with new data or NULL to finish the request
 typedef char *(shttpBodyCallback)(uint32_t sentBytes, uint32_t *len, void *userData);
 
-// cleanup callback, called to clean up user data pointer
-typedef void *(shttpCleanupCallback)(void *userData);
+// connection takeover callback, called after the response headers are sent
+// parameters are:
+// - the socket of the connection
+// - true if the client understands chunked transfer encoding, then the
+//   body has to be sent in chunks, else the end of the connection ends it
+// - user data pointer from above
+// return true to keep the socket, the server then neither reads from
+// nor closes it anymore
+typedef bool (shttpTakeoverCallback)(int socket, bool chunked, void *userData);
+
+// writer of JSON bodies, see shttp_json_object and friends
+typedef struct _shttpJSONWriter shttpJSONWriter;
+
+// JSON body callback, writes the body with the shttp_json_* functions.
+// It is called twice, once to measure the body for the Content-Length
+// header and once to send it, both times it has to write exactly the same
+// (take a snapshot of changing values in `userData` up front). If the
+// second body differs in length the connection is closed in the middle of
+// it, debug builds (DEBUG_LEVEL DEBUG or lower) assert.
+// parameters are:
+// - the writer
+// - user data pointer from above
+typedef void (shttpJSONCallback)(shttpJSONWriter *json, void *userData);
 
 // HTTP response, returned from route callback
 typedef struct _shttpResponse {
@@ -136,26 +311,49 @@ typedef struct _shttpResponse {
     // number of headers in array
     uint8_t headerCount;
 
+    // prebuilt status line and headers, sent as they are instead of the
+    // ones above (see shttp_prebuilt_response). The block has to end with
+    // "Connection: keep-alive\r\n\r\n", that line is swapped for
+    // "Connection: close" when the connection ends. It is constant data
+    // like a static body and may be in flash (word aligned)
+    const char *headerBlock;
+    uint16_t headerBlockLen;
+
     // the body to return, set to NULL to define callback or no data
     // Attention: you give this memory away, make sure it is on the
     // heap! Will be freed automatically after sending to the client.
+    // Constants are fine if `staticBody` is set.
     char *body;
     // body length,
     // - set to zero to use zero terminated string in body
-    // - if set to zero using the callback, the connection is
-    //   terminated when the response finishes
+    // - if set to zero using the callback, the body is sent with
+    //   chunked transfer encoding. HTTP/1.0 clients do not know that,
+    //   for them the connection is closed when the response finishes
     uint32_t bodyLen;
 
+    // the body is constant data, e.g. in flash (see shttp_static_response).
+    // It is never freed and sent in SHTTP_STATIC_CHUNK parts. Flash is read
+    // in whole words, keep flash data word aligned (STORE_ATTR)
+    bool staticBody;
+
     // user data pointer given to body callback
     void *callbackUserData;
 
     // body callback
     shttpBodyCallback *bodyCallback;
 
+    // JSON body callback, the body is written straight into the send
+    // buffer (see shttp_json_writer_response)
+    shttpJSONCallback *jsonCallback;
+
     // cleanup callback
     // is called whenever the response is finished (either erroring out
     // or finishing successfully) to clean up the user data pointer
     shttpCleanupCallback *cleanupCallback;
+
+    // takeover callback, set to keep the connection after the headers
+    // (see shttp_event_stream_response)
+    shttpTakeoverCallback *takeoverCallback;
 } shttpResponse;
 
 
@@ -172,6 +370,41 @@ typedef enum _shttpMethod {
 
 typedef shttpResponse *(shttpRouteCallback)(shttpRequest *request, void *userData);
 
+// request body callback of streaming routes
+// parameters are:
+// - the request, headers and parameters are already set
+// - the next part of the body, at most SHTTP_MAX_RECV_BUFFER bytes
+// - length of the part
+// - user data pointer of the route
+// return false to stop receiving, the route callback is called right
+// away and the connection is closed after the response
+typedef bool (shttpRequestBodyCallback)(shttpRequest *request, char *data, uint16_t len, void *userData);
+
+// WebSocket frame types
+typedef enum _shttpWebSocketOpcode {
+    shttpWebSocketContinuation = 0x0,
+    shttpWebSocketText = 0x1,
+    shttpWebSocketBinary = 0x2,
+    shttpWebSocketClose = 0x8,
+    shttpWebSocketPing = 0x9,
+    shttpWebSocketPong = 0xa
+} shttpWebSocketOpcode;
+
+typedef struct _shttpWebSocket shttpWebSocket;
+
+// message callback of WebSocket routes
+// parameters are:
+// - the connection, to answer with shttp_websocket_send. It moves between
+//   workers, do not keep the pointer after the callback returns
+// - text or binary, messages split into fragments arrive frame by frame,
+//   the following frames with shttpWebSocketContinuation
+// - true on the last frame of a message
+// - the payload, zero terminated, valid until the callback returns
+// - length of the payload
+// - user data pointer of the route
+// return false to close the connection
+typedef bool (shttpWebSocketCallback)(shttpWebSocket *websocket, shttpWebSocketOpcode opcode, bool final, char *data, uint16_t len, void *userData);
+
 typedef struct _shttpRoute {
     // allowed methods for this route, add them together to allow
     // multiple methods (flags)
@@ -188,14 +421,25 @@ typedef struct _shttpRoute {
     // user data sent to the callback
     void *userData;
 
+    // set to stream the request body to this callback while it is
+    // received instead of buffering it, then the body size is not limited
+    // by SHTTP_MAX_BODY_SIZE. A slow callback slows down the client.
+    shttpRequestBodyCallback *bodyCallback;
+
+    // set by shttp_websocket_route, gets the messages after the upgrade
+    shttpWebSocketCallback *websocketCallback;
+
+    // request metrics, allocated when the server starts
+    struct _shttpRouteMetrics *metrics;
+
     // if you define multiple routes with the same path and different
     // allowedMethods then the list is processed until a matching
     // entry is found.
 } shttpRoute;
 
 typedef struct _shttpConfig {
-    // Hostname of the device,
-    // set to NULL to listen to everything
+    // Hostname of the device, requests for other host names are answered
+    // with 421. Set to NULL to listen to everything
     char *hostName; 
 
     // Port to listen to. You can probably use stuff like 'http' here too
@@ -208,14 +452,18 @@ typedef struct _shttpConfig {
     bool appendSlashes;
 
     // defined routes (for callbacks), close with a NULL sentinel
-    // be aware that comparing the list is done sequentially, if no
-    // match could be found the next item is tried until we reach the
-    // end of the list and the server returns a 404
+    // the list is compiled into a lookup tree when the server starts.
+    // Literal path parts take precedence over parameters, parameters
+    // over wildcards. If no route matches the path the server returns a
+    // 404, if the path exists but not for the method a 405
     shttpRoute **routes;
 } shttpConfig;
 
 // Start the shttp server, this function does not return
 // use it in a thread or RTOS task.
+// The calling task runs the accept loop, with SHTTP_EVENT_LOOP it runs the
+// whole server including all route callbacks, so give it a stack of at
+// least SHTTP_STACK_SIZE.
 void shttp_listen(shttpConfig *config);
 
 // URL encode value, caller has to free the result
@@ -224,11 +472,25 @@ char *shttp_url_encode(char *value);
 // URL decode value, caller has to free the result
 char *shttp_url_decode(char *value);
 
+// allocate memory that is released when the response to `request` has
+// been sent, no need to free it. Returns NULL when the SHTTP_ARENA_SIZE
+// bytes of the arena are used up.
+// Attention: response bodies are freed after sending, do not put them here!
+// User data of responses is fine, the arena is reset after sending.
+void *shttp_request_alloc(shttpRequest *request, uint16_t size);
+
+// copy a string into the request arena
+char *shttp_request_strdup(shttpRequest *request, const char *value);
+
+// value of a known header, NULL if the request did not send it
+char *shttp_request_header(shttpRequest *request, shttpKnownHeader header);
+
 //
 // convenience functions
 //
 
 shttpRoute *shttp_route(shttpMethod method, char *path, shttpRouteCallback *callback, void *userData);
+shttpRoute *shttp_streaming_route(shttpMethod method, char *path, shttpRequestBodyCallback *bodyCallback, shttpRouteCallback *callback, void *userData);
 
 #define GET(_path, _callback, _ud) shttp_route(shttpMethodGET, (_path), (_callback), (_ud))
 #define POST(_path, _callback, _ud) shttp_route(shttpMethodPOST, (_path), (_callback), (_ud))
@@ -257,16 +519,112 @@ shttpResponse *shttp_text_response(shttpStatusCode status, char *text);
 shttpResponse *shttp_download_response(shttpStatusCode status, char *buffer, uint32_t len, char *filename);
 
 // return a download with the callback interface to conserve memory
-// if len is set to 0 the connection will be terminated after finishing
+// if len is set to 0 the body is sent chunked (or the connection is closed
+// after finishing for HTTP/1.0 clients)
 shttpResponse *shttp_download_callback_response(shttpStatusCode status, uint32_t len, char *filename, shttpBodyCallback *callback, void *userData, shttpCleanupCallback *cleanup);
 
+// return a response with a constant body (see `staticBody`), set len to 0
+// for a zero terminated string in RAM
+shttpResponse *shttp_static_response(shttpStatusCode status, char *contentType, const char *body, uint32_t len);
+
+// return a response with a prebuilt header block (see `headerBlock`), the
+// header block and the static body (may be NULL) are sent with two writes.
+// `status` has to match the status line of the block
+shttpResponse *shttp_prebuilt_response(shttpStatusCode status, const char *headerBlock, uint16_t headerBlockLen, const char *body, uint32_t bodyLen);
+
 #if SHTTP_CJSON
-// return a json response with correct headers set
+// return a json response with correct headers set, the tree is printed
+// compact and deleted
 shttpResponse *shttp_json_response(shttpStatusCode status, cJSON *json);
 #endif
 
+// return a json response that `callback` writes when it is sent, no tree
+// and no body buffer are allocated. `userData` has to stay valid until
+// then, use `cleanup` to free it (may be NULL)
+shttpResponse *shttp_json_writer_response(shttpStatusCode status, shttpJSONCallback *callback, void *userData, shttpCleanupCallback *cleanup);
+
+//
+// JSON writer
+//
+
+// The writer produces compact JSON. `key` is the member name inside of
+// objects, pass NULL for array elements and the top level value. Nesting
+// is limited to 31 levels.
+
+// start an object or array, close it with shttp_json_end
+void shttp_json_object(shttpJSONWriter *json, const char *key);
+void shttp_json_array(shttpJSONWriter *json, const char *key);
+void shttp_json_end(shttpJSONWriter *json);
+
+// values, numbers are written with up to 6 decimals (none from 1e9 on),
+// NaN, infinity and magnitudes of 1e15 and more become null
+void shttp_json_string(shttpJSONWriter *json, const char *key, const char *value);
+void shttp_json_number(shttpJSONWriter *json, const char *key, double value);
+void shttp_json_integer(shttpJSONWriter *json, const char *key, int32_t value);
+void shttp_json_bool(shttpJSONWriter *json, const char *key, bool value);
+void shttp_json_null(shttpJSONWriter *json, const char *key);
+
+// write the JSON of `callback` into `buffer`, like snprintf at most `size`
+// bytes including the terminator. Returns the length of the whole JSON,
+// `buffer` may be NULL to measure it
+uint32_t shttp_json_format(char *buffer, uint32_t size, shttpJSONCallback *callback, void *userData);
+
+// the JSON of `callback` as zero terminated string, caller has to free it
+char *shttp_json_print(shttpJSONCallback *callback, void *userData);
+
+//
+// WebSockets
+//
+
+// Upgrade requests to `path` to a WebSocket, `callback` gets the messages.
+// The connection stays with the server until it is closed. It uses a
+// worker only while frames arrive and is parked in between (in event loop
+// mode it holds a connection slot), at most SHTTP_MAX_WEBSOCKETS are open
+// at once. Clients that are idle for SHTTP_IDLE_TIMEOUT are pinged and
+// closed if they do not answer.
+shttpRoute *shttp_websocket_route(char *path, shttpWebSocketCallback *callback, void *userData);
+
+// send a frame to the client, returns false if the connection failed
+bool shttp_websocket_send(shttpWebSocket *websocket, shttpWebSocketOpcode opcode, const char *data, uint16_t len);
+
+#if SHTTP_METRICS
+//
+// Metrics
+//
+
+// Serve the request metrics of all routes in the Prometheus text format
+// on GET `path`. Request phases are timed from the accepted connection (or
+// the first byte of a following request) to the parsed headers, the
+// complete body, the returned route callback and the sent response.
+shttpRoute *shttp_metrics_route(char *path);
+#endif
+
+//
+// Server-Sent Events
+//
+
+// Clients subscribe to an event stream by requesting a route that returns
+// `shttp_event_stream_response`, their connection is then kept open and
+// every event sent to the stream is pushed to them. Clients that do not
+// keep up are dropped, browsers reconnect automatically. Every
+// SHTTP_IDLE_TIMEOUT the server sends a comment to all clients, so idle
+// streams stay open and clients that are gone are noticed.
+typedef struct _shttpEventStream shttpEventStream;
+
+// create an event stream
+shttpEventStream *shttp_event_stream(void);
+
+// subscribe the client to `stream`, `data` is sent to it as first event
+// (or NULL). Like response bodies `data` is freed after sending, if the
+// stream has SHTTP_MAX_EVENT_CLIENTS clients already the client gets a 503
+shttpResponse *shttp_event_stream_response(shttpEventStream *stream, char *data);
+
+// send an event to all clients of `stream`, `event` is the event type
+// (NULL for `message`), returns the number of clients reached
+uint8_t shttp_event_stream_send(shttpEventStream *stream, const char *event, const char *data);
+
 // add headers to `response`, allocates any memory needed, copies the input
-// - add as many headers you like
+// - add as many headers you like, calling it again adds more
 // - order is name, value
 // - end the list with NULL
 void shttp_response_add_headers(shttpResponse *response, ...);
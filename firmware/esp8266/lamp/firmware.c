@@ -0,0 +1,334 @@
+#include <esp_common.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+
+#include <simplehttp/http.h>
+#include <cJSON.h>
+
+#include "firmware.h"
+
+// time to send the response before restarting
+#define FIRMWARE_REBOOT_DELAY 1000
+
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+
+typedef struct _firmwareState {
+    // generation of the upload writing the update, 0 if there is none.
+    // The request buffers of the server are re-used, so the uploading
+    // request carries this in its userData
+    uint32_t generation;
+    portTickType startTime;
+
+    // set when the update failed, stops receiving
+    shttpStatusCode status;
+    char *error;
+
+    // slot that is written and the CRC32 the image should have
+    uint8 bin;
+    uint32_t address;
+    uint32_t size;
+    uint32_t expectedCRC;
+
+    // image bytes received and bytes already in flash
+    uint32_t received;
+    uint32_t written;
+
+    // one flash sector, spi_flash_write needs it word aligned
+    uint32_t *sector;
+    uint16_t sectorLen;
+} firmwareState;
+
+static firmwareState update;
+static uint32_t lastGeneration;
+
+// holds one token while no update runs
+static xQueueHandle updateLock;
+
+// address and size of a user bin slot, false if the flash map has no two slots
+static bool firmwareSlot(uint8 bin, uint32_t *address, uint32_t *size) {
+    uint32_t half;
+
+    switch (system_get_flash_size_map()) {
+        case FLASH_SIZE_4M_MAP_256_256:
+            half = 0x40000;
+            break;
+
+        case FLASH_SIZE_8M_MAP_512_512:
+        case FLASH_SIZE_16M_MAP_512_512:
+        case FLASH_SIZE_32M_MAP_512_512:
+            half = 0x80000;
+            break;
+
+        case FLASH_SIZE_16M_MAP_1024_1024:
+        case FLASH_SIZE_32M_MAP_1024_1024:
+        case FLASH_SIZE_64M_MAP_1024_1024:
+        case FLASH_SIZE_128M_MAP_1024_1024:
+            half = 0x100000;
+            break;
+
+        default:
+            return false;
+    }
+
+    // the slots start after the boot loader sector, the end of each
+    // half is reserved for the SDK parameters
+    *address = bin * half + 0x1000;
+    *size = half - 0x5000;
+    return true;
+}
+
+static uint8 firmwareNextBin(void) {
+    return (system_upgrade_userbin_check() == UPGRADE_FW_BIN1) ? UPGRADE_FW_BIN2 : UPGRADE_FW_BIN1;
+}
+
+// CRC32 as used by zlib, with a nibble table to save flash
+static uint32_t firmwareCRC32(uint32_t crc, const uint8_t *data, uint32_t len) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+        0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+    };
+
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc = (crc >> 4) ^ table[(crc ^ data[i]) & 0x0f];
+        crc = (crc >> 4) ^ table[(crc ^ (data[i] >> 4)) & 0x0f];
+    }
+    return ~crc;
+}
+
+static void firmwareFail(shttpStatusCode status, char *error) {
+    printf("Firmware update failed: %s\n", error);
+    update.status = status;
+    update.error = error;
+}
+
+// erase the next sector of the slot and program the buffered data
+static bool firmwareFlush(void) {
+    uint32_t address = update.address + update.written;
+
+    // the last part is padded to whole words with erased flash
+    while (update.sectorLen % 4 != 0) {
+        ((uint8_t *)update.sector)[update.sectorLen++] = 0xff;
+    }
+
+    if ((spi_flash_erase_sector(address / SPI_FLASH_SEC_SIZE) != SPI_FLASH_RESULT_OK) ||
+        (spi_flash_write(address, update.sector, update.sectorLen) != SPI_FLASH_RESULT_OK)) {
+        firmwareFail(shttpStatusInternalError, "Could not write flash");
+        return false;
+    }
+
+    update.written += update.sectorLen;
+    update.sectorLen = 0;
+    return true;
+}
+
+// read the image back from flash and compare the checksum
+static bool firmwareVerify(void) {
+    uint32_t crc = 0;
+
+    for (uint32_t offset = 0; offset < update.received; offset += SPI_FLASH_SEC_SIZE) {
+        uint32_t len = MIN(SPI_FLASH_SEC_SIZE, update.received - offset);
+        if (spi_flash_read(update.address + offset, update.sector, (len + 3) & ~3) != SPI_FLASH_RESULT_OK) {
+            firmwareFail(shttpStatusInternalError, "Could not read flash");
+            return false;
+        }
+        crc = firmwareCRC32(crc, (uint8_t *)update.sector, len);
+    }
+
+    if (crc != update.expectedCRC) {
+        firmwareFail(shttpStatusBadRequest, "Checksum mismatch");
+        return false;
+    }
+    return true;
+}
+
+// true if `request` is the upload writing the update
+static bool firmwareOwns(shttpRequest *request) {
+    return (request->userData != NULL) && ((uintptr_t)request->userData == update.generation);
+}
+
+// release the update lock
+static void firmwareEnd(void) {
+    free(update.sector);
+    memset(&update, 0, sizeof(firmwareState));
+
+    uint8_t token = 0;
+    xQueueSend(updateLock, &token, 0);
+}
+
+// request cleanup of the upload, gives up the update if the upload ended
+// without being answered (e.g. the client disconnected)
+static void *firmwareAbandon(void *userData) {
+    if ((userData != NULL) && ((uintptr_t)userData == update.generation)) {
+        printf("Firmware update: upload abandoned\n");
+        system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+        firmwareEnd();
+    }
+    return NULL;
+}
+
+// take the update lock for `request` and check the parameters, returns
+// false if another update is running. It stays taken until the upload is
+// answered or its connection goes away
+static bool firmwareStart(shttpRequest *request) {
+    uint8_t token;
+
+    if (xQueueReceive(updateLock, &token, 0) != pdTRUE) {
+        return false;
+    }
+
+    memset(&update, 0, sizeof(firmwareState));
+    if (++lastGeneration == 0) {
+        lastGeneration++;
+    }
+    update.generation = lastGeneration;
+    update.startTime = xTaskGetTickCount();
+    update.bin = firmwareNextBin();
+
+    request->userData = (void *)(uintptr_t)update.generation;
+    request->cleanupCallback = firmwareAbandon;
+
+    char *crc = NULL;
+    for (uint8_t i = 0; i < request->numParameters; i++) {
+        if (strcmp(request->parameters[i].name, "crc32") == 0) {
+            crc = request->parameters[i].value;
+        }
+    }
+
+    char *end = NULL;
+    if ((crc != NULL) && (*crc != '\0')) {
+        update.expectedCRC = strtoul(crc, &end, 16);
+    }
+    if ((end == NULL) || (*end != '\0')) {
+        firmwareFail(shttpStatusBadRequest, "Missing or invalid crc32 parameter");
+        return true;
+    }
+
+    if (!firmwareSlot(update.bin, &update.address, &update.size)) {
+        firmwareFail(shttpStatusInternalError, "Flash map has no update slot");
+        return true;
+    }
+
+    if (request->contentLength > update.size) {
+        firmwareFail(shttpStatusBadRequest, "Firmware image too big");
+        return true;
+    }
+
+    update.sector = malloc(SPI_FLASH_SEC_SIZE);
+    if (update.sector == NULL) {
+        firmwareFail(shttpStatusInternalError, "Out of memory");
+        return true;
+    }
+
+    printf("Firmware update: writing %u bytes to user%d.bin at 0x%x\n", request->contentLength, update.bin + 1, update.address);
+    system_upgrade_flag_set(UPGRADE_FLAG_START);
+    return true;
+}
+
+static void firmwareReboot(void *userData) {
+    vTaskDelay(FIRMWARE_REBOOT_DELAY / portTICK_RATE_MS);
+    system_upgrade_reboot();
+    vTaskDelete(NULL);
+}
+
+//
+// API
+//
+
+void firmwareInit(void) {
+    uint8_t token = 0;
+
+    updateLock = xQueueCreate(1, sizeof(uint8_t));
+    xQueueSend(updateLock, &token, 0);
+}
+
+bool firmwareReceive(shttpRequest *request, char *data, uint16_t len, void *userData) {
+    if (request->bodyReceived == 0) {
+        if (!firmwareStart(request)) {
+            return false;
+        }
+    } else if (!firmwareOwns(request)) {
+        return false;
+    }
+
+    if (update.error != NULL) {
+        return false;
+    }
+    update.received += len;
+
+    // collect whole sectors, each is erased and written in one go
+    while (len > 0) {
+        uint16_t part = MIN(len, SPI_FLASH_SEC_SIZE - update.sectorLen);
+        memcpy((uint8_t *)update.sector + update.sectorLen, data, part);
+        update.sectorLen += part;
+        data += part;
+        len -= part;
+
+        if ((update.sectorLen == SPI_FLASH_SEC_SIZE) && (!firmwareFlush())) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+shttpResponse *firmwareUpdate(shttpRequest *request, void *userData) {
+    if (!firmwareOwns(request)) {
+        if (request->contentLength == 0) {
+            return shttp_static_response(shttpStatusBadRequest, "text/plain", "No firmware image", 0);
+        }
+        return shttp_static_response(shttpStatusConflict, "text/plain", "Firmware update in progress", 0);
+    }
+
+    if ((update.error == NULL) && (update.sectorLen > 0)) {
+        firmwareFlush();
+    }
+    if (update.error == NULL) {
+        firmwareVerify();
+    }
+
+    if (update.error != NULL) {
+        shttpResponse *response = shttp_static_response(update.status, "text/plain", update.error, 0);
+        system_upgrade_flag_set(UPGRADE_FLAG_IDLE);
+        firmwareEnd();
+        return response;
+    }
+
+    // sustained throughput including erasing and reading back
+    uint32_t milliseconds = (xTaskGetTickCount() - update.startTime) * portTICK_RATE_MS;
+    printf("Firmware update: %u bytes in %u ms, restarting into user%d.bin\n", update.received, milliseconds, update.bin + 1);
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "bytes", cJSON_CreateNumber(update.received));
+    cJSON_AddItemToObject(root, "milliseconds", cJSON_CreateNumber(milliseconds));
+    cJSON_AddItemToObject(root, "bytesPerSecond", cJSON_CreateNumber((milliseconds > 0) ? update.received * 1000.0 / milliseconds : 0));
+    cJSON_AddItemToObject(root, "image", cJSON_CreateString((update.bin == UPGRADE_FW_BIN1) ? "user1.bin" : "user2.bin"));
+
+    system_upgrade_flag_set(UPGRADE_FLAG_FINISH);
+    firmwareEnd();
+    if (xTaskCreate(firmwareReboot, "reboot", 200, NULL, 2, NULL) != pdPASS) {
+        system_upgrade_reboot();
+    }
+
+    return shttp_json_response(shttpStatusOK, root);
+}
+
+shttpResponse *getFirmware(shttpRequest *request, void *userData) {
+    uint8 bin = firmwareNextBin();
+    uint32_t address, size;
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "running", cJSON_CreateString((bin == UPGRADE_FW_BIN1) ? "user2.bin" : "user1.bin"));
+    if (firmwareSlot(bin, &address, &size)) {
+        cJSON_AddItemToObject(root, "update", cJSON_CreateString((bin == UPGRADE_FW_BIN1) ? "user1.bin" : "user2.bin"));
+        cJSON_AddItemToObject(root, "maxSize", cJSON_CreateNumber(size));
+    }
+
+    return shttp_json_response(shttpStatusOK, root);
+}
@@ -0,0 +1,26 @@
+#ifndef lamp_firmware_h_included
+#define lamp_firmware_h_included
+
+#include <simplehttp/http.h>
+
+// Firmware update over HTTP
+//
+// `POST /firmware?crc32=<hex>` streams the image into the user bin slot
+// that is not running while it is received. After the upload the slot is
+// read back and compared with the CRC32 of the image, only if it matches
+// the boot loader is switched over and the lamp restarts.
+//
+// `GET /firmware` tells which image (`user1.bin` or `user2.bin`) the next
+// update has to be.
+
+// create the update lock, call before the server starts
+void firmwareInit(void);
+
+// streaming route callbacks of `POST /firmware`
+bool firmwareReceive(shttpRequest *request, char *data, uint16_t len, void *userData);
+shttpResponse *firmwareUpdate(shttpRequest *request, void *userData);
+
+// route callback of `GET /firmware`
+shttpResponse *getFirmware(shttpRequest *request, void *userData);
+
+#endif /* lamp_firmware_h_included */
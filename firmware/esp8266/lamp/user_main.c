@@ -1,11 +1,13 @@
 #include <esp_common.h>
 
+#include <string.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
+#include <freertos/queue.h>
 
 #include <simplehttp/http.h>
 #include <mdns/mdns.h>
@@ -13,8 +15,18 @@
 
 #include <files.h>
 
+#include "firmware.h"
+
 #define HOSTNAME "wohnzimmerlampe"
 
+// port of the HTTP server, the host build overrides this
+#ifndef HTTP_PORT
+#define HTTP_PORT 80
+#endif
+
+#define STRINGIFY(_x) #_x
+#define TOSTRING(_x) STRINGIFY(_x)
+
 void startup(void *userData);
 
 mdnsHandle *mdns;
@@ -32,10 +44,45 @@ static float lowPowerRing = 1.0;
 static float highPowerRing = 0.0;
 static Mode mode = modeWhite;
 
-typedef struct _getFileData {
+// clients following the parameters, see GET /events
+static shttpEventStream *events;
+
+// the parameters are shared by all server tasks, holds one token while
+// nobody uses them
+static xQueueHandle parametersLock;
+
+// holds one token while the Arduino has to be updated, changes that arrive
+// while the UART task is busy are sent together with the next update
+static xQueueHandle arduinoUpdate;
+
+static void lockParameters(void) {
+    uint8_t token;
+    xQueueReceive(parametersLock, &token, portMAX_DELAY);
+}
+
+static void unlockParameters(void) {
+    uint8_t token = 0;
+    xQueueSend(parametersLock, &token, 0);
+}
+
+// a web asset and its prebuilt response headers from `files.h`
+typedef struct _asset {
     const char *data;
     const uint32_t size;
-    char *mimeType;
+    char *etag;
+    const char *response;
+    const uint16_t responseLen;
+    const char *notModified;
+    const uint16_t notModifiedLen;
+} asset;
+
+#define ASSET(_name) { _name, _name##_len, _name##_etag, _name##_response, _name##_response_len, _name##_not_modified, _name##_not_modified_len }
+
+typedef struct _getFileData {
+    asset plain;
+
+    // gzip compressed variant, data is NULL if there is none
+    asset gzip;
 } getFileData;
 
 /******************************************************************************
@@ -97,12 +144,14 @@ void ICACHE_FLASH_ATTR wifi_event_handler_cb(System_Event_t *event) {
         }
         running = 1;
         
-        if (xTaskCreate(startup, "server", 250, NULL, 4, NULL) != pdPASS) {
+        // the server runs in this task: the accept loop or, in event loop
+        // mode, the parser and all route callbacks
+        if (xTaskCreate(startup, "server", SHTTP_STACK_SIZE, NULL, 4, NULL) != pdPASS) {
             printf("HTTP Startup failed!\n");
         } else {
             mdns = mdns_create(HOSTNAME);
             mdns_update_ip(mdns, event->event_info.got_ip.ip);    
-            mdnsService *service = mdns_create_service("_http", mdnsProtocolTCP, 80);
+            mdnsService *service = mdns_create_service("_http", mdnsProtocolTCP, HTTP_PORT);
             // mdns_service_add_txt(service, "bla", "blubb");
             mdns_add_service(mdns, service);
             mdns_start(mdns);
@@ -110,64 +159,279 @@ void ICACHE_FLASH_ATTR wifi_event_handler_cb(System_Event_t *event) {
     }
 }
 
-static void sendValuesToArduino(void) {
-    printf("mode=%d\n", mode);
+// true if the Accept style `header` of the request lists `token`
+static bool headerAccepts(shttpRequest *request, shttpKnownHeader header, const char *token) {
+    char *accept = shttp_request_header(request, header);
+    if (accept == NULL) {
+        return false;
+    }
+
+    char *found = strstr(accept, token);
+    if (found == NULL) {
+        return false;
+    }
+
+    // "token;q=0" explicitly refuses it
+    char *params = found + strlen(token);
+    while (*params == ' ') {
+        params++;
+    }
+    if (*params == ';') {
+        params++;
+        while (*params == ' ') {
+            params++;
+        }
+        if ((strncmp(params, "q=", 2) == 0) && (atof(params + 2) <= 0)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static const char *modeName(Mode value) {
+    switch(value) {
+        case modeWhite:
+            return "white";
+        case modeCinema:
+            return "cinema";
+        case modeMoodlight:
+            return "moodlight";
+    }
+    return NULL;
+}
+
+// the parameters as the clients see them
+typedef struct _parameters {
+    float hue;
+    float saturation;
+    float brightness;
+    float lowPower;
+    float highPower;
+    Mode mode;
+} parameters;
+
+// call with the lock held
+static void currentParameters(parameters *values) {
+    values->hue = hue;
+    values->saturation = saturation;
+    values->brightness = brightness;
+    values->lowPower = lowPowerRing;
+    values->highPower = highPowerRing;
+    values->mode = mode;
+}
+
+// a consistent copy of the parameters
+static void snapshotParameters(parameters *values) {
+    lockParameters();
+    currentParameters(values);
+    unlockParameters();
+}
+
+static void sendValuesToArduino(parameters *values) {
+    printf("mode=%d\n", values->mode);
     vTaskDelay(20 / portTICK_RATE_MS);
-    printf("hue=%d\n", (int)(hue * 255.0));
+    printf("hue=%d\n", (int)(values->hue * 255.0));
     vTaskDelay(20 / portTICK_RATE_MS);
-    printf("saturation=%d\n", (int)(saturation * 255.0));
+    printf("saturation=%d\n", (int)(values->saturation * 255.0));
     vTaskDelay(20 / portTICK_RATE_MS);
-    printf("brightness=%d\n", (int)(brightness * 255.0));
+    printf("brightness=%d\n", (int)(values->brightness * 255.0));
     vTaskDelay(20 / portTICK_RATE_MS);
-    printf("lowpowerring=%d\n", (int)(lowPowerRing * 255.0));
+    printf("lowpowerring=%d\n", (int)(values->lowPower * 255.0));
     vTaskDelay(20 / portTICK_RATE_MS);
-    printf("highpowerring=%d\n", (int)(highPowerRing * 255.0));
+    printf("highpowerring=%d\n", (int)(values->highPower * 255.0));
     vTaskDelay(20 / portTICK_RATE_MS);
 }
 
-static cJSON *buildResponse(void) {
-    cJSON *root = cJSON_CreateObject();
-    cJSON *jsHue = cJSON_CreateNumber(hue);
-    cJSON *jsSaturation = cJSON_CreateNumber(saturation);
-    cJSON *jsBrightness = cJSON_CreateNumber(brightness);
-    cJSON *jsLowPower = cJSON_CreateNumber(lowPowerRing);
-    cJSON *jsHighPower = cJSON_CreateNumber(highPowerRing);
-    cJSON *jsMode = NULL;
-    switch(mode) {
-        case modeWhite:
-            jsMode = cJSON_CreateString("white");
-            break;
-        case modeCinema:
-            jsMode = cJSON_CreateString("cinema");
-            break;
-        case modeMoodlight:
-            jsMode = cJSON_CreateString("moodlight");
-            break;
+// The Arduino needs 120 ms for an update. It gets the latest values from
+// this task, so the server tasks do not wait for the UART and a slider drag
+// only sends the values the Arduino has time for
+static void arduinoTask(void *userData) {
+    uint8_t token;
+    parameters values;
+
+    while (1) {
+        xQueueReceive(arduinoUpdate, &token, portMAX_DELAY);
+        snapshotParameters(&values);
+        sendValuesToArduino(&values);
     }
-    cJSON_AddItemToObject(root, "hue", jsHue);
-    cJSON_AddItemToObject(root, "saturation", jsSaturation);
-    cJSON_AddItemToObject(root, "brightness", jsBrightness);
-    cJSON_AddItemToObject(root, "lowPower", jsLowPower);
-    cJSON_AddItemToObject(root, "highPower", jsHighPower);
-    cJSON_AddItemToObject(root, "mode", jsMode);
-    
-    return root;
+}
+
+// the parameters changed, a pending update already sends the new values
+static void updateArduino(void) {
+    uint8_t token = 0;
+    xQueueSend(arduinoUpdate, &token, 0);
+}
+
+static void writeParameters(shttpJSONWriter *json, void *userData) {
+    parameters *values = userData;
+
+    shttp_json_object(json, NULL);
+    shttp_json_number(json, "hue", values->hue);
+    shttp_json_number(json, "saturation", values->saturation);
+    shttp_json_number(json, "brightness", values->brightness);
+    shttp_json_number(json, "lowPower", values->lowPower);
+    shttp_json_number(json, "highPower", values->highPower);
+    shttp_json_string(json, "mode", modeName(values->mode));
+    shttp_json_end(json);
+}
+
+// the JSON is written while sending, so the values are copied into the
+// request arena to not change in between
+static shttpResponse *jsonParametersResponse(shttpRequest *request) {
+    parameters *values = shttp_request_alloc(request, sizeof(parameters));
+    if (values == NULL) {
+        return shttp_empty_response(shttpStatusInternalError);
+    }
+    snapshotParameters(values);
+
+    shttpResponse *response = shttp_json_writer_response(shttpStatusOK, writeParameters, values, NULL);
+    shttp_response_add_headers(response, "Vary", "Accept", NULL);
+    return response;
+}
+
+// Compact binary form of the parameters, used instead of JSON when the
+// request has it as Content-Type or in Accept. 24 bytes, little endian:
+//
+//   0  version (1)
+//   1  mode (0 white, 1 cinema, 2 moodlight)
+//   2  fields that are set, bit 0-4 the floats in order, bit 5 the mode
+//   3  zero
+//   4  hue, saturation, brightness, lowPower, highPower as IEEE 754 floats
+//
+// Responses have all fields set, POST bodies only the ones to change.
+#define PARAMETERS_BINARY_TYPE "application/vnd.wohnzimmerlampe.parameters"
+#define PARAMETERS_BINARY_VERSION 1
+#define PARAMETERS_BINARY_LEN 24
+#define PARAMETERS_BINARY_FLOATS 5
+#define PARAMETERS_BINARY_MODE 0x20
+#define PARAMETERS_BINARY_ALL 0x3f
+
+static float *const binaryFloats[PARAMETERS_BINARY_FLOATS] = {
+    &hue, &saturation, &brightness, &lowPowerRing, &highPowerRing
+};
+
+static void putFloat(uint8_t *out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, 4);
+    out[0] = bits;
+    out[1] = bits >> 8;
+    out[2] = bits >> 16;
+    out[3] = bits >> 24;
+}
+
+static float getFloat(const uint8_t *in) {
+    uint32_t bits = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+    float value;
+    memcpy(&value, &bits, 4);
+    return value;
+}
+
+static shttpResponse *binaryParametersResponse(void) {
+    uint8_t *body = malloc(PARAMETERS_BINARY_LEN);
+    if (body == NULL) {
+        return shttp_empty_response(shttpStatusInternalError);
+    }
+
+    parameters values;
+    snapshotParameters(&values);
+
+    body[0] = PARAMETERS_BINARY_VERSION;
+    body[1] = values.mode;
+    body[2] = PARAMETERS_BINARY_ALL;
+    body[3] = 0;
+    putFloat(body + 4, values.hue);
+    putFloat(body + 8, values.saturation);
+    putFloat(body + 12, values.brightness);
+    putFloat(body + 16, values.lowPower);
+    putFloat(body + 20, values.highPower);
+
+    shttpResponse *response = shttp_empty_response(shttpStatusOK);
+    shttp_response_add_headers(response,
+        "Content-Type", PARAMETERS_BINARY_TYPE,
+        "Vary", "Accept",
+        NULL);
+    response->body = (char *)body;
+    response->bodyLen = PARAMETERS_BINARY_LEN;
+    return response;
+}
+
+static shttpResponse *parametersResponse(shttpRequest *request) {
+    if (headerAccepts(request, SHTTP_HDR_ACCEPT, PARAMETERS_BINARY_TYPE)) {
+        return binaryParametersResponse();
+    }
+    return jsonParametersResponse(request);
 }
 
 static shttpResponse *getParameters(shttpRequest *request, void *userData) {
-    cJSON *root = buildResponse();
-    return shttp_json_response(shttpStatusOK, root);
+    return parametersResponse(request);
 }
 
-static shttpResponse *setParameters(shttpRequest *request, void *userData) {
+typedef struct _parameterChange {
+    parameters before;
+    parameters after;
+} parameterChange;
+
+// only the members that changed
+static void writeChanges(shttpJSONWriter *json, void *userData) {
+    parameterChange *change = userData;
+
+    shttp_json_object(json, NULL);
+    if (change->after.hue != change->before.hue) {
+        shttp_json_number(json, "hue", change->after.hue);
+    }
+    if (change->after.saturation != change->before.saturation) {
+        shttp_json_number(json, "saturation", change->after.saturation);
+    }
+    if (change->after.brightness != change->before.brightness) {
+        shttp_json_number(json, "brightness", change->after.brightness);
+    }
+    if (change->after.lowPower != change->before.lowPower) {
+        shttp_json_number(json, "lowPower", change->after.lowPower);
+    }
+    if (change->after.highPower != change->before.highPower) {
+        shttp_json_number(json, "highPower", change->after.highPower);
+    }
+    if (change->after.mode != change->before.mode) {
+        shttp_json_string(json, "mode", modeName(change->after.mode));
+    }
+    shttp_json_end(json);
+}
+
+// tell the event stream clients which parameters differ, `change` is
+// taken with the lock held but sent without it
+static void sendChanges(parameterChange *change) {
+    char *data = shttp_json_print(writeChanges, change);
+    if (data == NULL) {
+        return;
+    }
+    if (strcmp(data, "{}") != 0) {
+        shttp_event_stream_send(events, NULL, data);
+    }
+    free(data);
+}
+
+static shttpResponse *getEvents(shttpRequest *request, void *userData) {
+    parameters values;
+    snapshotParameters(&values);
+
+    return shttp_event_stream_response(events, shttp_json_print(writeParameters, &values));
+}
+
+// set the parameters found in the JSON object `json`, tells the Arduino
+// and the event stream clients, returns false if `json` can not be parsed
+static bool applyParameters(char *json) {
     cJSON *item;
-    cJSON *root = cJSON_Parse(request->bodyData);
+    parameterChange change;
+
+    cJSON *root = cJSON_Parse(json);
     if (!root) {
-        printf("Body len: %d", request->bodyLen);
-        printf("%s", request->bodyData);
-        return shttp_text_response(shttpStatusBadRequest, "Could not parse JSON");
+        printf("%s", json);
+        return false;
     }
 
+    lockParameters();
+    currentParameters(&change.before);
+
     item = cJSON_GetObjectItem(root, "hue");
     if (item) {
         hue = item->valuedouble;
@@ -204,23 +468,125 @@ static shttpResponse *setParameters(shttpRequest *request, void *userData) {
             mode = modeMoodlight;
         }
     }
+
+    currentParameters(&change.after);
+    unlockParameters();
+
+    sendChanges(&change);
+    updateArduino();
+
     cJSON_Delete(root);
+    return true;
+}
+
+// set the parameters of the binary form in `data`, like applyParameters,
+// returns false if it is not valid
+static bool applyBinaryParameters(const uint8_t *data, uint32_t len) {
+    if ((len != PARAMETERS_BINARY_LEN) || (data[0] != PARAMETERS_BINARY_VERSION)) {
+        return false;
+    }
+    uint8_t fields = data[2];
+    if ((fields & ~PARAMETERS_BINARY_ALL) || ((fields & PARAMETERS_BINARY_MODE) && (data[1] > modeMoodlight))) {
+        return false;
+    }
+    for (uint8_t i = 0; i < PARAMETERS_BINARY_FLOATS; i++) {
+        float value = getFloat(data + 4 + 4 * i);
+        if ((fields & (1 << i)) && (!((value >= -1e9) && (value <= 1e9)))) {
+            // NaN or out of any sensible range
+            return false;
+        }
+    }
 
-    sendValuesToArduino();
+    parameterChange change;
+    lockParameters();
+    currentParameters(&change.before);
 
-    root = buildResponse();
-    return shttp_json_response(shttpStatusOK, root);
+    for (uint8_t i = 0; i < PARAMETERS_BINARY_FLOATS; i++) {
+        if (fields & (1 << i)) {
+            *binaryFloats[i] = getFloat(data + 4 + 4 * i);
+        }
+    }
+    if (fields & PARAMETERS_BINARY_MODE) {
+        mode = data[1];
+    }
+
+    currentParameters(&change.after);
+    unlockParameters();
+
+    sendChanges(&change);
+    updateArduino();
+
+    return true;
+}
+
+// true if the body of the request is the binary form
+static bool isBinaryParameters(shttpRequest *request) {
+    char *contentType = shttp_request_header(request, SHTTP_HDR_CONTENT_TYPE);
+    if (contentType == NULL) {
+        return false;
+    }
+
+    uint8_t len = strlen(PARAMETERS_BINARY_TYPE);
+    return (strncasecmp(contentType, PARAMETERS_BINARY_TYPE, len) == 0) &&
+        ((contentType[len] == '\0') || (contentType[len] == ';') || (contentType[len] == ' '));
+}
+
+static shttpResponse *setParameters(shttpRequest *request, void *userData) {
+    if (isBinaryParameters(request)) {
+        if (!applyBinaryParameters((uint8_t *)request->bodyData, request->bodyLen)) {
+            return shttp_static_response(shttpStatusBadRequest, "text/plain", "Invalid binary parameters", 0);
+        }
+    } else if (!applyParameters(request->bodyData)) {
+        printf("Body len: %d", request->bodyLen);
+        return shttp_static_response(shttpStatusBadRequest, "text/plain", "Could not parse JSON", 0);
+    }
+
+    return parametersResponse(request);
+}
+
+// every text message on the socket is a JSON object like the body of
+// POST /parameters, binary messages are the binary form. There are no
+// answers
+static bool parameterSocket(shttpWebSocket *websocket, shttpWebSocketOpcode opcode, bool final, char *data, uint16_t len, void *userData) {
+    if (((opcode != shttpWebSocketText) && (opcode != shttpWebSocketBinary)) || (!final)) {
+        printf("Ignoring WebSocket message\n");
+        return true;
+    }
+
+    if (opcode == shttpWebSocketBinary) {
+        if (!applyBinaryParameters((uint8_t *)data, len)) {
+            printf("Invalid binary WebSocket message\n");
+        }
+    } else if (!applyParameters(data)) {
+        printf("Could not parse WebSocket message\n");
+    }
+    return true;
+}
+
+// true if the If-None-Match header of the request lists `etag`
+static bool etagMatches(shttpRequest *request, char *etag) {
+    char *ifNoneMatch = shttp_request_header(request, SHTTP_HDR_IF_NONE_MATCH);
+    if (ifNoneMatch == NULL) {
+        return false;
+    }
+
+    // the etag is quoted, so a substring match does not hit partial tags
+    return (strcmp(ifNoneMatch, "*") == 0) || (strstr(ifNoneMatch, etag) != NULL);
 }
 
+// the headers of the assets are built with them (see web/Makefile), they
+// are sent as they are
 static shttpResponse *getFile(shttpRequest *request, void *userData) {
     getFileData *fileData = (getFileData *)userData;
 
-    shttpResponse *response = shttp_empty_response(shttpStatusOK);
-    shttp_response_add_headers(response, "Content-Type", fileData->mimeType, NULL);
-    response->body = (char *)fileData->data;
-    response->bodyLen = fileData->size;
+    bool gzip = (fileData->gzip.data != NULL) && (headerAccepts(request, SHTTP_HDR_ACCEPT_ENCODING, "gzip"));
+    asset *file = (gzip) ? &fileData->gzip : &fileData->plain;
 
-    return response;
+    // the client has this version already, tell it without the body
+    if (etagMatches(request, file->etag)) {
+        return shttp_prebuilt_response(shttpStatusNotModified, file->notModified, file->notModifiedLen, NULL, 0);
+    }
+    return shttp_prebuilt_response(shttpStatusOK, file->response, file->responseLen, file->data, file->size);
 }
 
 /******************************************************************************
@@ -246,11 +612,11 @@ void startup(void *userData) {
     shttpConfig config;
 
     // set a hostname, if a request with a different host header
-    // arrives the server will automatically return 404
+    // arrives the server will automatically return 421
     config.hostName = HOSTNAME ".local";
 
     // the port to use, default should be 80
-    config.port = "80";
+    config.port = TOSTRING(HTTP_PORT);
 
     // we don't care if the url ends with a slash
     config.appendSlashes = 1;
@@ -258,15 +624,34 @@ void startup(void *userData) {
     config.routes = (shttpRoute *[]){
         GET( "/parameters",  getParameters, NULL),
         POST("/parameters", setParameters, NULL),
-        GET( "",                getFile, &((getFileData){ index_html,     index_html_len,     "text/html" })),
-        GET( "/main.css",       getFile, &((getFileData){ main_css,       main_css_len,       "text/css" })),
-        GET( "/main.js",        getFile, &((getFileData){ main_js,        main_js_len,        "text/javascript" })),
-        GET( "/favicon.ico",    getFile, &((getFileData){ favicon_ico,    favicon_ico_len,    "image/x-icon" })),
-        GET( "/hexagon.png",    getFile, &((getFileData){ hexagon_png,    hexagon_png_len,    "image/png" })),
-        GET( "/colorwheel.jpg", getFile, &((getFileData){ colorwheel_jpg, colorwheel_jpg_len, "image/jpeg" })),
+        shttp_websocket_route("/parameters/socket", parameterSocket, NULL),
+        GET( "/events",     getEvents, NULL),
+        GET( "/firmware",   getFirmware, NULL),
+#if SHTTP_METRICS
+        shttp_metrics_route("/metrics"),
+#endif
+        shttp_streaming_route(shttpMethodPOST, "/firmware", firmwareReceive, firmwareUpdate, NULL),
+        GET( "",                getFile, &((getFileData){ ASSET(index_html),     ASSET(index_html_gz) })),
+        GET( "/main.css",       getFile, &((getFileData){ ASSET(main_css),       ASSET(main_css_gz) })),
+        GET( "/main.js",        getFile, &((getFileData){ ASSET(main_js),        ASSET(main_js_gz) })),
+        GET( "/favicon.ico",    getFile, &((getFileData){ ASSET(favicon_ico),    ASSET(favicon_ico_gz) })),
+        GET( "/hexagon.png",    getFile, &((getFileData){ ASSET(hexagon_png) })),
+        GET( "/colorwheel.jpg", getFile, &((getFileData){ ASSET(colorwheel_jpg) })),
         NULL
     };
 
+    firmwareInit();
+    events = shttp_event_stream();
+
+    uint8_t token = 0;
+    parametersLock = xQueueCreate(1, sizeof(uint8_t));
+    xQueueSend(parametersLock, &token, 0);
+
+    arduinoUpdate = xQueueCreate(1, sizeof(uint8_t));
+    if (xTaskCreate(arduinoTask, "arduino", 256, NULL, 3, NULL) != pdPASS) {
+        printf("Arduino update task failed!\n");
+    }
+
     // start the server, this never returns
     shttp_listen(&config);
 }
@@ -0,0 +1,58 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "debug.h"
+
+// keep allocations aligned for word access
+#define SHTTP_ARENA_ALIGN(_size) (((_size) + 3) & ~3)
+
+void shttp_arena_reset(shttpArena *arena) {
+    arena->used = 0;
+}
+
+void shttp_arena_destroy(shttpArena *arena) {
+    if (arena->memory != NULL) {
+        free(arena->memory);
+        arena->memory = NULL;
+    }
+    arena->used = 0;
+}
+
+//
+// API
+//
+
+void *shttp_request_alloc(shttpRequest *request, uint16_t size) {
+    shttpArena *arena = request->arena;
+
+    if (arena->memory == NULL) {
+        arena->memory = malloc(SHTTP_ARENA_SIZE);
+        if (arena->memory == NULL) {
+            LOG(ERROR, "shttp: Out of memory while creating request arena");
+            return NULL;
+        }
+    }
+
+    if (SHTTP_ARENA_ALIGN(size) > SHTTP_ARENA_SIZE - arena->used) {
+        LOG(ERROR, "shttp: Request arena exhausted (%d bytes requested, %d used)", size, arena->used);
+        return NULL;
+    }
+
+    void *result = arena->memory + arena->used;
+    arena->used += SHTTP_ARENA_ALIGN(size);
+    return result;
+}
+
+char *shttp_request_strdup(shttpRequest *request, const char *value) {
+    uint16_t len = strlen(value);
+    char *result = shttp_request_alloc(request, len + 1);
+    if (result == NULL) {
+        return NULL;
+    }
+
+    memcpy(result, value, len + 1);
+    return result;
+}
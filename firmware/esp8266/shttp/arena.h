@@ -0,0 +1,19 @@
+#ifndef shttp_arena_h_included
+#define shttp_arena_h_included
+
+#include "simplehttp/http.h"
+
+// bump pointer allocator for memory that lives as long as a request,
+// the block is allocated on first use and kept for the connection
+typedef struct _shttpArena {
+    char *memory;
+    uint16_t used;
+} shttpArena;
+
+// release everything allocated from the arena at once
+void shttp_arena_reset(shttpArena *arena);
+
+// free the arena block
+void shttp_arena_destroy(shttpArena *arena);
+
+#endif /* shttp_arena_h_included */
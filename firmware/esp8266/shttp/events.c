@@ -0,0 +1,265 @@
+#include "simplehttp/http.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include "debug.h"
+#include "events.h"
+
+// room in front of a message for the chunk size line and behind it for
+// the line break ending the chunk
+#define SHTTP_EVENT_HEADROOM 6
+#define SHTTP_EVENT_TAILROOM 2
+
+struct _shttpEventStream {
+    // all streams, for the keep-alive
+    shttpEventStream *next;
+
+    // holds one token while nobody uses the client list
+    xQueueHandle lock;
+
+    uint8_t numClients;
+    int sockets[SHTTP_MAX_EVENT_CLIENTS];
+    bool chunked[SHTTP_MAX_EVENT_CLIENTS];
+};
+
+// streams are never destroyed, new ones are added in front once complete
+static shttpEventStream *streams = NULL;
+
+// user data of the subscription response
+typedef struct _shttpEventSubscription {
+    shttpEventStream *stream;
+    char *data;
+} shttpEventSubscription;
+
+static void shttp_event_stream_lock(shttpEventStream *stream) {
+    uint8_t token;
+    xQueueReceive(stream->lock, &token, portMAX_DELAY);
+}
+
+static void shttp_event_stream_unlock(shttpEventStream *stream) {
+    uint8_t token = 0;
+    xQueueSend(stream->lock, &token, 0);
+}
+
+// build a message for `data`, one `data:` line per line. The message
+// starts at SHTTP_EVENT_HEADROOM in the returned buffer
+static char *shttp_event_message(const char *event, const char *data, uint16_t *len) {
+    // measure
+    uint32_t size = 0;
+    if (event != NULL) {
+        size += 7 + strlen(event) + 1;
+    }
+    const char *line = data;
+    do {
+        const char *end = strchr(line, '\n');
+        uint32_t lineLen = (end != NULL) ? end - line : strlen(line);
+        size += 6 + lineLen + 1;
+        line = (end != NULL) ? end + 1 : NULL;
+    } while (line != NULL);
+    size += 1;
+
+    if (size > UINT16_MAX - SHTTP_EVENT_HEADROOM - SHTTP_EVENT_TAILROOM) {
+        LOG(ERROR, "shttp: event too big");
+        return NULL;
+    }
+    char *buffer = malloc(SHTTP_EVENT_HEADROOM + size + SHTTP_EVENT_TAILROOM + 1);
+    if (buffer == NULL) {
+        LOG(ERROR, "shttp: Out of memory while building event");
+        return NULL;
+    }
+
+    // build
+    char *out = buffer + SHTTP_EVENT_HEADROOM;
+    if (event != NULL) {
+        out += sprintf(out, "event: %s\n", event);
+    }
+    line = data;
+    do {
+        const char *end = strchr(line, '\n');
+        uint32_t lineLen = (end != NULL) ? end - line : strlen(line);
+        memcpy(out, "data: ", 6);
+        memcpy(out + 6, line, lineLen);
+        out[6 + lineLen] = '\n';
+        out += 6 + lineLen + 1;
+        line = (end != NULL) ? end + 1 : NULL;
+    } while (line != NULL);
+    *out = '\n';
+
+    *len = size;
+    return buffer;
+}
+
+// frame the message in `buffer` as chunk, returns the offset the chunk starts at
+static uint16_t shttp_event_frame(char *buffer, uint16_t len) {
+    char sizeLine[SHTTP_EVENT_HEADROOM + 1];
+    uint8_t sizeLen = sprintf(sizeLine, "%x\r\n", len);
+
+    memcpy(buffer + SHTTP_EVENT_HEADROOM - sizeLen, sizeLine, sizeLen);
+    memcpy(buffer + SHTTP_EVENT_HEADROOM + len, "\r\n", 2);
+    return SHTTP_EVENT_HEADROOM - sizeLen;
+}
+
+// send a framed message without blocking, a client that can not take it
+// at once is too slow (or gone) and has to be dropped
+static bool shttp_event_write(int socket, bool chunked, char *buffer, uint16_t start, uint16_t len) {
+    const char *data = buffer + SHTTP_EVENT_HEADROOM;
+    if (chunked) {
+        data = buffer + start;
+        len += SHTTP_EVENT_HEADROOM - start + SHTTP_EVENT_TAILROOM;
+    }
+    return send(socket, data, len, MSG_DONTWAIT) == len;
+}
+
+// send a framed message to all clients, call with the lock held
+static uint8_t shttp_event_broadcast(shttpEventStream *stream, char *buffer, uint16_t len) {
+    uint16_t start = shttp_event_frame(buffer, len);
+
+    uint8_t i = 0;
+    while (i < stream->numClients) {
+        if (shttp_event_write(stream->sockets[i], stream->chunked[i], buffer, start, len)) {
+            i++;
+            continue;
+        }
+
+        LOG(DEBUG, "shttp: dropping event stream client");
+        close(stream->sockets[i]);
+        stream->numClients--;
+        stream->sockets[i] = stream->sockets[stream->numClients];
+        stream->chunked[i] = stream->chunked[stream->numClients];
+    }
+
+    return stream->numClients;
+}
+
+// free a slot if a client is gone, call with the lock held
+static bool shttp_event_stream_has_room(shttpEventStream *stream) {
+    if (stream->numClients < SHTTP_MAX_EVENT_CLIENTS) {
+        return true;
+    }
+
+    // clients that closed the connection fail to take a comment
+    char probe[SHTTP_EVENT_HEADROOM + 2 + SHTTP_EVENT_TAILROOM];
+    memcpy(probe + SHTTP_EVENT_HEADROOM, ":\n", 2);
+    shttp_event_broadcast(stream, probe, 2);
+
+    return stream->numClients < SHTTP_MAX_EVENT_CLIENTS;
+}
+
+static bool shttp_event_stream_subscribe(int socket, bool chunked, void *userData) {
+    shttpEventSubscription *subscription = userData;
+    shttpEventStream *stream = subscription->stream;
+
+    shttp_event_stream_lock(stream);
+
+    // the stream may have filled up since the response was created
+    bool ok = shttp_event_stream_has_room(stream);
+    if ((ok) && (subscription->data != NULL)) {
+        uint16_t len;
+        char *buffer = shttp_event_message(NULL, subscription->data, &len);
+        ok = (buffer != NULL) && shttp_event_write(socket, chunked, buffer, shttp_event_frame(buffer, len), len);
+        free(buffer);
+    }
+    if (ok) {
+        stream->sockets[stream->numClients] = socket;
+        stream->chunked[stream->numClients] = chunked;
+        stream->numClients++;
+        LOG(DEBUG, "shttp: event stream client %d subscribed", stream->numClients);
+    }
+
+    shttp_event_stream_unlock(stream);
+    return ok;
+}
+
+static void *shttp_event_subscription_cleanup(void *userData) {
+    shttpEventSubscription *subscription = userData;
+
+    free(subscription->data);
+    free(subscription);
+    return NULL;
+}
+
+//
+// API
+//
+
+shttpEventStream *shttp_event_stream(void) {
+    shttpEventStream *stream = calloc(1, sizeof(shttpEventStream));
+    if (stream == NULL) {
+        return NULL;
+    }
+
+    stream->lock = xQueueCreate(1, sizeof(uint8_t));
+    if (stream->lock == NULL) {
+        free(stream);
+        return NULL;
+    }
+    shttp_event_stream_unlock(stream);
+
+    stream->next = streams;
+    streams = stream;
+
+    return stream;
+}
+
+shttpResponse *shttp_event_stream_response(shttpEventStream *stream, char *data) {
+    shttp_event_stream_lock(stream);
+    bool full = !shttp_event_stream_has_room(stream);
+    shttp_event_stream_unlock(stream);
+
+    shttpEventSubscription *subscription = NULL;
+    if (!full) {
+        subscription = malloc(sizeof(shttpEventSubscription));
+    }
+    if (subscription == NULL) {
+        LOG(WARN, "shttp: can not subscribe client to event stream");
+        free(data);
+        return shttp_empty_response(shttpStatusServiceUnavailable);
+    }
+    subscription->stream = stream;
+    subscription->data = data;
+
+    shttpResponse *response = shttp_empty_response(shttpStatusOK);
+    shttp_response_add_headers(response,
+        "Content-Type", "text/event-stream",
+        "Cache-Control", "no-cache",
+        NULL);
+    response->takeoverCallback = shttp_event_stream_subscribe;
+    response->cleanupCallback = shttp_event_subscription_cleanup;
+    response->callbackUserData = subscription;
+
+    return response;
+}
+
+uint8_t shttp_event_stream_send(shttpEventStream *stream, const char *event, const char *data) {
+    uint16_t len;
+    char *buffer = shttp_event_message(event, data, &len);
+    if (buffer == NULL) {
+        return 0;
+    }
+
+    shttp_event_stream_lock(stream);
+    uint8_t numClients = shttp_event_broadcast(stream, buffer, len);
+    shttp_event_stream_unlock(stream);
+
+    free(buffer);
+    return numClients;
+}
+
+void shttp_events_keepalive(void) {
+    for (shttpEventStream *stream = streams; stream != NULL; stream = stream->next) {
+        char comment[SHTTP_EVENT_HEADROOM + 3 + SHTTP_EVENT_TAILROOM];
+        memcpy(comment + SHTTP_EVENT_HEADROOM, ":\n\n", 3);
+
+        shttp_event_stream_lock(stream);
+        shttp_event_broadcast(stream, comment, 3);
+        shttp_event_stream_unlock(stream);
+    }
+}
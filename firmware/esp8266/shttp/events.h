@@ -0,0 +1,11 @@
+#ifndef shttp_events_h_included
+#define shttp_events_h_included
+
+#include "simplehttp/http.h"
+
+// send a comment to the clients of all event streams, call every
+// SHTTP_IDLE_TIMEOUT. Keeps proxies and browsers from closing idle streams
+// and drops clients that are gone
+void shttp_events_keepalive(void);
+
+#endif /* shttp_events_h_included */
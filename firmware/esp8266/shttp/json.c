@@ -0,0 +1,294 @@
+#include "json.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "debug.h"
+#include "response.h"
+
+#if DEBUG_LEVEL <= DEBUG
+#include <assert.h>
+#endif
+
+#ifndef MIN
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+#endif
+
+// deepest nesting, one bit per level in `members` and `arrays`
+#define SHTTP_JSON_MAX_DEPTH 31
+
+struct _shttpJSONWriter {
+    char *buffer;     // output, NULL to measure only
+    uint32_t size;    // size of the buffer
+    uint32_t fill;    // bytes in the buffer
+    uint32_t len;     // bytes written in total
+    uint32_t limit;   // bytes beyond this are dropped
+    int socket;       // a full buffer is sent here, -1 for none
+    uint32_t *sent;   // bytes sent to the socket
+    bool ok;          // false after the connection failed
+    uint8_t depth;    // nesting level
+    uint32_t members; // the object or array on this level has members
+    uint32_t arrays;  // the container on this level is an array
+};
+
+static void shttp_json_init(shttpJSONWriter *json, char *buffer, uint32_t size, int socket, uint32_t *sent) {
+    memset(json, 0, sizeof(shttpJSONWriter));
+    json->buffer = buffer;
+    json->size = size;
+    json->limit = UINT32_MAX;
+    json->socket = socket;
+    json->sent = sent;
+    json->ok = true;
+}
+
+static bool shttp_json_flush(shttpJSONWriter *json) {
+    if ((json->socket < 0) || (!json->ok)) {
+        return false;
+    }
+    json->ok = shttp_send_all(json->socket, json->buffer, json->fill);
+    *json->sent += json->fill;
+    json->fill = 0;
+    return json->ok;
+}
+
+static void shttp_json_put(shttpJSONWriter *json, const char *data, uint32_t len) {
+    uint32_t room = json->limit - MIN(json->len, json->limit);
+    json->len += len;
+    if (json->buffer == NULL) {
+        return;
+    }
+
+    len = MIN(len, room);
+    while (len > 0) {
+        if ((json->fill == json->size) && (!shttp_json_flush(json))) {
+            // nowhere to put it
+            return;
+        }
+        uint32_t part = MIN(len, json->size - json->fill);
+        memcpy(json->buffer + json->fill, data, part);
+        json->fill += part;
+        data += part;
+        len -= part;
+    }
+}
+
+static void shttp_json_put_string(shttpJSONWriter *json, const char *value) {
+    shttp_json_put(json, "\"", 1);
+    while (*value != '\0') {
+        // plain characters go out in runs
+        const char *start = value;
+        while ((*value != '\0') && (*value != '"') && (*value != '\\') && ((uint8_t)*value >= 0x20)) {
+            value++;
+        }
+        shttp_json_put(json, start, value - start);
+        if (*value == '\0') {
+            break;
+        }
+
+        char escape[7];
+        switch (*value) {
+            case '"': strcpy(escape, "\\\""); break;
+            case '\\': strcpy(escape, "\\\\"); break;
+            case '\n': strcpy(escape, "\\n"); break;
+            case '\r': strcpy(escape, "\\r"); break;
+            case '\t': strcpy(escape, "\\t"); break;
+            default:
+                sprintf(escape, "\\u%04x", (uint8_t)*value);
+                break;
+        }
+        shttp_json_put(json, escape, strlen(escape));
+        value++;
+    }
+    shttp_json_put(json, "\"", 1);
+}
+
+// separator and member name in front of a value
+static void shttp_json_key(shttpJSONWriter *json, const char *key) {
+    uint32_t level = 1u << json->depth;
+    if (json->members & level) {
+        shttp_json_put(json, ",", 1);
+    }
+    json->members |= level;
+
+    if ((json->depth > 0) && (!(json->arrays & level)) && (key != NULL)) {
+        shttp_json_put_string(json, key);
+        shttp_json_put(json, ":", 1);
+    }
+}
+
+static void shttp_json_open(shttpJSONWriter *json, const char *key, bool array) {
+    if (json->depth == SHTTP_JSON_MAX_DEPTH) {
+        LOG(ERROR, "shttp: JSON nested too deep");
+        return;
+    }
+    shttp_json_key(json, key);
+    shttp_json_put(json, (array) ? "[" : "{", 1);
+
+    json->depth++;
+    uint32_t level = 1u << json->depth;
+    json->members &= ~level;
+    if (array) {
+        json->arrays |= level;
+    } else {
+        json->arrays &= ~level;
+    }
+}
+
+// run `callback` on a writer into `buffer`
+static uint32_t shttp_json_run(char *buffer, uint32_t size, shttpJSONCallback *callback, void *userData) {
+    shttpJSONWriter json;
+    shttp_json_init(&json, buffer, size, -1, NULL);
+    callback(&json, userData);
+    return json.len;
+}
+
+//
+// Internal
+//
+
+uint32_t shttp_json_measure(shttpResponse *response) {
+    return shttp_json_run(NULL, 0, response->jsonCallback, response->callbackUserData);
+}
+
+bool shttp_json_write(shttpResponse *response, uint32_t len, char *buffer, uint32_t size, int socket, uint32_t *sent) {
+    shttpJSONWriter json;
+    shttp_json_init(&json, buffer, size, socket, sent);
+    json.limit = len;
+    response->jsonCallback(&json, response->callbackUserData);
+
+#if DEBUG_LEVEL <= DEBUG
+    // callbacks have to write the same body twice, catch those that do not
+    assert(json.len == len);
+#endif
+    if (json.len != len) {
+        // the Content-Length is out already. The rest of the buffer is
+        // dropped and the connection closed, so the client sees a short
+        // body instead of a complete looking one that is broken
+        LOG(ERROR, "shttp: JSON body changed from %d to %d bytes while sending", len, json.len);
+        return false;
+    }
+    if ((socket >= 0) && (json.fill > 0)) {
+        shttp_json_flush(&json);
+    }
+    return json.ok;
+}
+
+//
+// API
+//
+
+void shttp_json_object(shttpJSONWriter *json, const char *key) {
+    shttp_json_open(json, key, false);
+}
+
+void shttp_json_array(shttpJSONWriter *json, const char *key) {
+    shttp_json_open(json, key, true);
+}
+
+void shttp_json_end(shttpJSONWriter *json) {
+    if (json->depth == 0) {
+        return;
+    }
+    uint32_t level = 1u << json->depth;
+    shttp_json_put(json, (json->arrays & level) ? "]" : "}", 1);
+    json->depth--;
+}
+
+void shttp_json_string(shttpJSONWriter *json, const char *key, const char *value) {
+    shttp_json_key(json, key);
+    if (value == NULL) {
+        shttp_json_put(json, "null", 4);
+        return;
+    }
+    shttp_json_put_string(json, value);
+}
+
+void shttp_json_number(shttpJSONWriter *json, const char *key, double value) {
+    shttp_json_key(json, key);
+
+    // NaN fails both comparisons
+    if (!((value > -1e15) && (value < 1e15))) {
+        shttp_json_put(json, "null", 4);
+        return;
+    }
+
+    // fixed point with 6 decimals, printf may not know floats. Big numbers
+    // have no precision left for them
+    bool negative = (value < 0);
+    if (negative) {
+        value = -value;
+    }
+    uint8_t digits = (value < 1e9) ? 6 : 0;
+    uint64_t fixed = (uint64_t)(value * ((digits > 0) ? 1e6 : 1) + 0.5);
+    uint64_t integer = (digits > 0) ? fixed / 1000000 : fixed;
+    uint32_t fraction = (digits > 0) ? fixed % 1000000 : 0;
+
+    // digits from the end, the fraction without trailing zeros
+    char text[1 + 15 + 1 + 6];
+    char *p = text + sizeof(text);
+    while ((digits > 0) && (fraction % 10 == 0)) {
+        fraction /= 10;
+        digits--;
+    }
+    if (digits > 0) {
+        for (uint8_t i = 0; i < digits; i++) {
+            *--p = '0' + fraction % 10;
+            fraction /= 10;
+        }
+        *--p = '.';
+    }
+    do {
+        *--p = '0' + integer % 10;
+        integer /= 10;
+    } while (integer > 0);
+    if ((negative) && (fixed > 0)) {
+        *--p = '-';
+    }
+    shttp_json_put(json, p, text + sizeof(text) - p);
+}
+
+void shttp_json_integer(shttpJSONWriter *json, const char *key, int32_t value) {
+    char text[12];
+    shttp_json_key(json, key);
+    shttp_json_put(json, text, sprintf(text, "%d", value));
+}
+
+void shttp_json_bool(shttpJSONWriter *json, const char *key, bool value) {
+    shttp_json_key(json, key);
+    if (value) {
+        shttp_json_put(json, "true", 4);
+    } else {
+        shttp_json_put(json, "false", 5);
+    }
+}
+
+void shttp_json_null(shttpJSONWriter *json, const char *key) {
+    shttp_json_key(json, key);
+    shttp_json_put(json, "null", 4);
+}
+
+uint32_t shttp_json_format(char *buffer, uint32_t size, shttpJSONCallback *callback, void *userData) {
+    if ((buffer == NULL) || (size == 0)) {
+        return shttp_json_run(NULL, 0, callback, userData);
+    }
+
+    // leave room for the terminator
+    uint32_t len = shttp_json_run(buffer, size - 1, callback, userData);
+    buffer[MIN(len, size - 1)] = '\0';
+    return len;
+}
+
+char *shttp_json_print(shttpJSONCallback *callback, void *userData) {
+    uint32_t len = shttp_json_run(NULL, 0, callback, userData);
+    char *result = malloc(len + 1);
+    if (result == NULL) {
+        LOG(ERROR, "shttp: Out of memory while printing JSON");
+        return NULL;
+    }
+    shttp_json_format(result, len + 1, callback, userData);
+    return result;
+}
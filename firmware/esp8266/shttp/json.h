@@ -0,0 +1,15 @@
+#ifndef shttp_json_h_included
+#define shttp_json_h_included
+
+#include "simplehttp/http.h"
+
+// the length of the body of a JSON writer response
+uint32_t shttp_json_measure(shttpResponse *response);
+
+// write the body of a JSON writer response, `len` bytes as measured
+// before, into `buffer`. A full buffer is sent to `socket`, pass -1 if the
+// body fits. Returns false if the connection failed or the callback wrote
+// a different length this time, close the connection then
+bool shttp_json_write(shttpResponse *response, uint32_t len, char *buffer, uint32_t size, int socket, uint32_t *sent);
+
+#endif /* shttp_json_h_included */
@@ -0,0 +1,403 @@
+#include "simplehttp/http.h"
+
+#if SHTTP_METRICS
+
+#include <esp_common.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include "debug.h"
+#include "metrics.h"
+
+#ifndef MIN
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+#endif
+
+extern shttpConfig *shttpServerConfig;
+
+// upper bounds of the latency buckets, the last bucket is +Inf
+#define SHTTP_METRICS_BUCKETS 6
+static const uint32_t bucketBounds[SHTTP_METRICS_BUCKETS - 1] = { 1000, 5000, 25000, 100000, 500000 };
+static const char *bucketLabels[SHTTP_METRICS_BUCKETS] = { "0.001", "0.005", "0.025", "0.1", "0.5", "+Inf" };
+
+// phases of a request, see shttpRequestTiming
+#define SHTTP_METRICS_PHASES 4
+static const char *phaseLabels[SHTTP_METRICS_PHASES] = { "receive", "body", "handler", "send" };
+
+// status classes 1xx to 5xx
+#define SHTTP_METRICS_CLASSES 5
+
+// size of one chunk of the exposition, a chunk holds the series of one
+// route (and phase), longer paths are cut off in the labels
+#define SHTTP_METRICS_CHUNK 1024
+#define SHTTP_METRICS_MAX_PATH 64
+
+typedef struct _shttpHistogram {
+    uint32_t counts[SHTTP_METRICS_BUCKETS]; // not cumulative
+    uint64_t sum; // microseconds
+} shttpHistogram;
+
+typedef struct _shttpRouteMetrics {
+    shttpHistogram phases[SHTTP_METRICS_PHASES];
+    uint32_t responses[SHTTP_METRICS_CLASSES];
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+} shttpRouteMetrics;
+
+// the metric families, served one after the other
+typedef enum _shttpMetricsFamily {
+    shttpMetricsServer = 0,
+    shttpMetricsDuration,
+    shttpMetricsResponses,
+    shttpMetricsBytesIn,
+    shttpMetricsBytesOut,
+    shttpMetricsDone
+} shttpMetricsFamily;
+
+// position of the exposition, user data of the metrics response
+typedef struct _shttpMetricsCursor {
+    shttpMetricsFamily family;
+    uint8_t route; // numRoutes is the unmatched requests
+    uint8_t phase;
+    uint8_t numRoutes;
+} shttpMetricsCursor;
+
+typedef struct _shttpMetricsBuffer {
+    char *data;
+    uint16_t len;
+} shttpMetricsBuffer;
+
+// holds one token while nobody updates the metrics
+static xQueueHandle metricsLock;
+
+// requests that did not match a route (404, 405, 413, 421, ...)
+static shttpRouteMetrics unmatchedMetrics;
+
+static uint32_t connectionsAccepted;
+static uint8_t queueDepth;
+static uint8_t maxQueueDepth;
+static uint32_t minFreeHeap = UINT32_MAX;
+
+static void shttp_metrics_lock(void) {
+    uint8_t token;
+    xQueueReceive(metricsLock, &token, portMAX_DELAY);
+}
+
+static void shttp_metrics_unlock(void) {
+    uint8_t token = 0;
+    xQueueSend(metricsLock, &token, 0);
+}
+
+static void shttp_histogram_add(shttpHistogram *histogram, uint32_t duration) {
+    uint8_t bucket = 0;
+    while ((bucket < SHTTP_METRICS_BUCKETS - 1) && (duration > bucketBounds[bucket])) {
+        bucket++;
+    }
+    histogram->counts[bucket]++;
+    histogram->sum += duration;
+}
+
+static shttpRouteMetrics *shttp_metrics_for_route(shttpRoute *route) {
+    return (route != NULL) ? route->metrics : &unmatchedMetrics;
+}
+
+static void shttp_metrics_append(shttpMetricsBuffer *out, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    int written = vsnprintf(out->data + out->len, SHTTP_METRICS_CHUNK - out->len, format, ap);
+    va_end(ap);
+
+    if (written > 0) {
+        out->len = MIN(out->len + written, SHTTP_METRICS_CHUNK - 1);
+    }
+}
+
+// `method` and `path` labels of a route, NULL for the unmatched requests
+static void shttp_metrics_labels(shttpRoute *route, char *labels) {
+    static const char *names[] = { "GET", "POST", "PUT", "PATCH", "DELETE", "OPTIONS", "HEAD" };
+
+    if (route == NULL) {
+        strcpy(labels, "method=\"\",path=\"(none)\"");
+        return;
+    }
+
+    // all methods of the route, comma separated
+    char *out = labels + sprintf(labels, "method=\"");
+    bool first = true;
+    for (uint8_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (route->allowedMethods & (1 << i)) {
+            out += sprintf(out, "%s%s", (first) ? "" : ",", names[i]);
+            first = false;
+        }
+    }
+    sprintf(out, "\",path=\"%.*s\"", SHTTP_METRICS_MAX_PATH, route->path);
+}
+
+static void shttp_metrics_family(shttpMetricsBuffer *out, const char *name, const char *type, const char *help) {
+    shttp_metrics_append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void shttp_metrics_server(shttpMetricsBuffer *out) {
+    shttp_metrics_lock();
+    uint32_t accepted = connectionsAccepted;
+    uint8_t depth = queueDepth;
+    uint8_t maxDepth = maxQueueDepth;
+    uint32_t minHeap = minFreeHeap;
+    shttp_metrics_unlock();
+
+    uint32_t freeHeap = system_get_free_heap_size();
+    if (minHeap > freeHeap) {
+        minHeap = freeHeap;
+    }
+
+    shttp_metrics_family(out, "shttp_connections_total", "counter", "Connections accepted.");
+    shttp_metrics_append(out, "shttp_connections_total %u\n", accepted);
+    shttp_metrics_family(out, "shttp_connection_queue_depth", "gauge", "Connections waiting for a worker when the last one was accepted.");
+    shttp_metrics_append(out, "shttp_connection_queue_depth %u\n", depth);
+    shttp_metrics_family(out, "shttp_connection_queue_depth_max", "gauge", "Most connections waiting for a worker.");
+    shttp_metrics_append(out, "shttp_connection_queue_depth_max %u\n", maxDepth);
+    shttp_metrics_family(out, "shttp_free_heap_bytes", "gauge", "Free heap.");
+    shttp_metrics_append(out, "shttp_free_heap_bytes %u\n", freeHeap);
+    shttp_metrics_family(out, "shttp_free_heap_min_bytes", "gauge", "Lowest free heap seen while serving.");
+    shttp_metrics_append(out, "shttp_free_heap_min_bytes %u\n", minHeap);
+}
+
+// write the series of one route (and phase) for the family the cursor is at
+static void shttp_metrics_series(shttpMetricsBuffer *out, shttpMetricsCursor *cursor) {
+    shttpRoute *route = NULL;
+    if (cursor->route < cursor->numRoutes) {
+        route = shttpServerConfig->routes[cursor->route];
+        if (route->metrics == NULL) {
+            return;
+        }
+    }
+
+    char labels[8 + 45 + 8 + SHTTP_METRICS_MAX_PATH + 2];
+    shttp_metrics_labels(route, labels);
+
+    // copy, the server goes on while this is formatted
+    shttp_metrics_lock();
+    shttpRouteMetrics metrics = *shttp_metrics_for_route(route);
+    shttp_metrics_unlock();
+
+    switch (cursor->family) {
+        case shttpMetricsDuration: {
+            shttpHistogram *histogram = &metrics.phases[cursor->phase];
+            uint32_t count = 0;
+            for (uint8_t i = 0; i < SHTTP_METRICS_BUCKETS; i++) {
+                count += histogram->counts[i];
+                shttp_metrics_append(out, "shttp_request_duration_seconds_bucket{%s,phase=\"%s\",le=\"%s\"} %u\n",
+                    labels, phaseLabels[cursor->phase], bucketLabels[i], count);
+            }
+            // no 64 bit formats in the SDK printf
+            shttp_metrics_append(out, "shttp_request_duration_seconds_sum{%s,phase=\"%s\"} %u.%06u\n",
+                labels, phaseLabels[cursor->phase], (uint32_t)(histogram->sum / 1000000), (uint32_t)(histogram->sum % 1000000));
+            shttp_metrics_append(out, "shttp_request_duration_seconds_count{%s,phase=\"%s\"} %u\n",
+                labels, phaseLabels[cursor->phase], count);
+            break;
+        }
+        case shttpMetricsResponses:
+            for (uint8_t i = 0; i < SHTTP_METRICS_CLASSES; i++) {
+                shttp_metrics_append(out, "shttp_responses_total{%s,code=\"%dxx\"} %u\n", labels, i + 1, metrics.responses[i]);
+            }
+            break;
+        case shttpMetricsBytesIn:
+            shttp_metrics_append(out, "shttp_request_bytes_total{%s} %u\n", labels, metrics.bytesIn);
+            break;
+        case shttpMetricsBytesOut:
+            shttp_metrics_append(out, "shttp_response_bytes_total{%s} %u\n", labels, metrics.bytesOut);
+            break;
+        default:
+            break;
+    }
+}
+
+// move on to the next route (and phase) or the next family
+static void shttp_metrics_advance(shttpMetricsCursor *cursor) {
+    if ((cursor->family == shttpMetricsDuration) && (cursor->phase + 1 < SHTTP_METRICS_PHASES)) {
+        cursor->phase++;
+        return;
+    }
+    cursor->phase = 0;
+
+    if ((cursor->family != shttpMetricsServer) && (cursor->route < cursor->numRoutes)) {
+        cursor->route++;
+        return;
+    }
+    cursor->route = 0;
+    cursor->family++;
+}
+
+static char *shttp_metrics_body(uint32_t sentBytes, uint32_t *len, void *userData) {
+    shttpMetricsCursor *cursor = userData;
+    if (cursor->family == shttpMetricsDone) {
+        return NULL;
+    }
+
+    shttpMetricsBuffer out = { malloc(SHTTP_METRICS_CHUNK), 0 };
+    if (out.data == NULL) {
+        LOG(ERROR, "shttp: Out of memory while serving metrics");
+        return NULL;
+    }
+
+    if ((cursor->route == 0) && (cursor->phase == 0)) {
+        switch (cursor->family) {
+            case shttpMetricsDuration:
+                shttp_metrics_family(&out, "shttp_request_duration_seconds", "histogram", "Time spent in each phase of a request.");
+                break;
+            case shttpMetricsResponses:
+                shttp_metrics_family(&out, "shttp_responses_total", "counter", "Responses sent by status class.");
+                break;
+            case shttpMetricsBytesIn:
+                shttp_metrics_family(&out, "shttp_request_bytes_total", "counter", "Bytes received in requests.");
+                break;
+            case shttpMetricsBytesOut:
+                shttp_metrics_family(&out, "shttp_response_bytes_total", "counter", "Bytes sent in responses.");
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (cursor->family == shttpMetricsServer) {
+        shttp_metrics_server(&out);
+    } else {
+        shttp_metrics_series(&out, cursor);
+    }
+    shttp_metrics_advance(cursor);
+
+    *len = out.len;
+    return out.data;
+}
+
+static void *shttp_metrics_cleanup(void *userData) {
+    free(userData);
+    return NULL;
+}
+
+static shttpResponse *shttp_metrics_response(shttpRequest *request, void *userData) {
+    shttpMetricsCursor *cursor = calloc(1, sizeof(shttpMetricsCursor));
+    if (cursor == NULL) {
+        return shttp_empty_response(shttpStatusServiceUnavailable);
+    }
+    while (shttpServerConfig->routes[cursor->numRoutes] != NULL) {
+        cursor->numRoutes++;
+    }
+
+    shttpResponse *response = shttp_empty_response(shttpStatusOK);
+    shttp_response_add_headers(response,
+        "Content-Type", "text/plain; version=0.0.4",
+        "Cache-Control", "no-cache",
+        NULL);
+    response->bodyCallback = shttp_metrics_body;
+    response->cleanupCallback = shttp_metrics_cleanup;
+    response->callbackUserData = cursor;
+
+    return response;
+}
+
+//
+// Internal API
+//
+
+bool shttp_metrics_init(shttpRoute **routes) {
+    if (metricsLock == NULL) {
+        metricsLock = xQueueCreate(1, sizeof(uint8_t));
+        if (metricsLock == NULL) {
+            return false;
+        }
+        shttp_metrics_unlock();
+    }
+
+    // routes without counters are left out of the metrics
+    for (uint8_t i = 0; routes[i] != NULL; i++) {
+        routes[i]->metrics = calloc(1, sizeof(shttpRouteMetrics));
+        if (routes[i]->metrics == NULL) {
+            LOG(WARN, "shttp: Out of memory, no metrics for %s", routes[i]->path);
+        }
+    }
+
+    return true;
+}
+
+void shttp_metrics_destroy(shttpRoute **routes) {
+    for (uint8_t i = 0; routes[i] != NULL; i++) {
+        free(routes[i]->metrics);
+        routes[i]->metrics = NULL;
+    }
+}
+
+uint32_t shttp_metrics_now(void) {
+    return system_get_time();
+}
+
+void shttp_metrics_connection(uint8_t queued) {
+    uint32_t freeHeap = system_get_free_heap_size();
+
+    shttp_metrics_lock();
+    connectionsAccepted++;
+    queueDepth = queued;
+    if (queued > maxQueueDepth) {
+        maxQueueDepth = queued;
+    }
+    if (freeHeap < minFreeHeap) {
+        minFreeHeap = freeHeap;
+    }
+    shttp_metrics_unlock();
+}
+
+void shttp_metrics_heap(void) {
+    uint32_t freeHeap = system_get_free_heap_size();
+
+    shttp_metrics_lock();
+    if (freeHeap < minFreeHeap) {
+        minFreeHeap = freeHeap;
+    }
+    shttp_metrics_unlock();
+}
+
+void shttp_metrics_request(shttpRoute *route, shttpRequestTiming *timing, shttpStatusCode status, uint32_t bytesOut) {
+    shttpRouteMetrics *metrics = shttp_metrics_for_route(route);
+    if (metrics == NULL) {
+        return;
+    }
+
+    // unsigned differences survive the wrap of the clock
+    uint32_t sent = shttp_metrics_now();
+    uint32_t durations[SHTTP_METRICS_PHASES] = {
+        timing->parsed - timing->start,
+        timing->handler - timing->parsed,
+        timing->handled - timing->handler,
+        sent - timing->handled
+    };
+    uint8_t statusClass = (status / 100) - 1;
+
+    shttp_metrics_lock();
+    for (uint8_t i = 0; i < SHTTP_METRICS_PHASES; i++) {
+        shttp_histogram_add(&metrics->phases[i], durations[i]);
+    }
+    if (statusClass < SHTTP_METRICS_CLASSES) {
+        metrics->responses[statusClass]++;
+    }
+    metrics->bytesIn += timing->bytesIn;
+    metrics->bytesOut += bytesOut;
+    shttp_metrics_unlock();
+}
+
+//
+// API
+//
+
+shttpRoute *shttp_metrics_route(char *path) {
+    return shttp_route(shttpMethodGET, path, shttp_metrics_response, NULL);
+}
+
+#endif /* SHTTP_METRICS */
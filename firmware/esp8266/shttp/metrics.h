@@ -0,0 +1,43 @@
+#ifndef shttp_metrics_h_included
+#define shttp_metrics_h_included
+
+#include "simplehttp/http.h"
+
+// when the phases of a request ended, in microseconds
+typedef struct _shttpRequestTiming {
+    uint32_t start;   // connection accepted or first byte of a following request
+    uint32_t parsed;  // header block complete
+    uint32_t handler; // body complete, route callback called
+    uint32_t handled; // route callback returned
+    uint32_t bytesIn; // size of the request
+} shttpRequestTiming;
+
+#if SHTTP_METRICS
+// set up the counters of all routes, call before serving
+bool shttp_metrics_init(shttpRoute **routes);
+void shttp_metrics_destroy(shttpRoute **routes);
+
+// current time in microseconds, wraps every 71 minutes
+uint32_t shttp_metrics_now(void);
+
+// a connection has been accepted, `queued` is the number of connections
+// waiting for a worker (open connections in event loop mode)
+void shttp_metrics_connection(uint8_t queued);
+
+// sample the free heap for the low-water mark
+void shttp_metrics_heap(void);
+
+// the response to a request for `route` (NULL if none matched) has been sent
+void shttp_metrics_request(shttpRoute *route, shttpRequestTiming *timing, shttpStatusCode status, uint32_t bytesOut);
+#else
+// the arguments are still used, so variables only kept for the metrics
+// do not cause warnings
+#define shttp_metrics_init(_routes) ((void)(_routes), true)
+#define shttp_metrics_destroy(_routes) ((void)(_routes))
+#define shttp_metrics_now() (0)
+#define shttp_metrics_connection(_queued) ((void)(_queued))
+#define shttp_metrics_heap() ((void)0)
+#define shttp_metrics_request(_route, _timing, _status, _bytesOut) ((void)(_route), (void)(_timing), (void)(_status), (void)(_bytesOut))
+#endif /* SHTTP_METRICS */
+
+#endif /* shttp_metrics_h_included */
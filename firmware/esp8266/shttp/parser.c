@@ -7,11 +7,15 @@
 #include <stdarg.h>
 #include <ctype.h>
 #include <string.h>
+#include <strings.h>
 
 #include "debug.h"
 #include "router.h"
 #include "urlcoder.h"
 #include "response.h"
+#include "arena.h"
+#include "websocket.h"
+#include "metrics.h"
 
 #ifndef MIN
 #define MIN(a,b) \
@@ -22,249 +26,584 @@
 
 extern shttpConfig *shttpServerConfig;
 
+// part of the connection buffer
+typedef struct _shttpView {
+    uint16_t offset;
+    uint16_t len;
+} shttpView;
+
+typedef struct _shttpKeyValueView {
+    shttpView name;
+    shttpView value;
+} shttpKeyValueView;
+
+// where the parser is in the request
+typedef enum _shttpParseStep {
+    shttpParseMethod = 0,
+    shttpParseTarget,
+    shttpParseQuery,
+    shttpParseVersion,
+    shttpParseHeaderName,
+    shttpParseHeaderValue,
+    shttpParseBody
+} shttpParseStep;
+
 typedef struct _shttpParserState {
-    bool introductionFinished;
-    bool headerFinished;
+    // the connection buffer, requests are received into it and tokenized
+    // in place. It may move when it grows, so the tokens are stored as
+    // views and only turned into pointers when the route is called
+    char *buffer;
+    uint16_t bufferSize;
+    uint16_t bufferLen;
+
+    // the request is parsed byte by byte as it arrives, parsing resumes
+    // at `parsePosition` in `step` when more data is received
+    shttpParseStep step;
+    uint16_t parsePosition; // next byte to look at
+    uint16_t tokenStart;    // start of the method, path, parameter, version or header line
+    uint16_t valueStart;    // start of a parameter or header value, 0 if not seen yet
+    uint16_t nameEnd;       // end of the header name
+    uint16_t headerLen;     // start of the body
     uint32_t expectedBodySize;
 
-    shttpRequest request;
+    // route resolved when the headers are complete
+    shttpRoute *route;
+    shttpMethod allowedMethods;
+    bool streamAborted;
+
+    // the request has been answered right after the headers, its body is dropped
+    bool rejected;
+
     shttpMethod method;
-    char *path;
+    shttpView path;
+    shttpKeyValueView headerViews[SHTTP_MAX_HEADERS];
+    uint16_t knownHeaderOffsets[SHTTP_HDR_COUNT]; // value offsets, 0 if missing
+    shttpKeyValueView parameterViews[SHTTP_MAX_PARAMETERS];
+
+    // request given to the route callback, points into the buffer
+    shttpRequest request;
+    shttpHeader headers[SHTTP_MAX_HEADERS];
+    shttpParameter parameters[SHTTP_MAX_PARAMETERS];
+    char *pathParameters[SHTTP_MAX_PATH_PARAMETERS];
+
+    // memory route callbacks allocate for the request
+    shttpArena arena;
 
-    uint8_t allocatedHeaders;
-    uint8_t allocatedParameters;
+    // static data of responses is sent through this, see shttp_parser_init_state
+    uint32_t *staticChunk;
+
+    // when the phases of the request ended, for the metrics
+    shttpRequestTiming timing;
+
+    // persistent connection handling
+    bool keepAlive;
+    bool http10;
+    uint8_t requestCount;
+
+    // after an upgrade the buffer holds WebSocket frames, callback is set then
+    shttpWebSocket websocket;
 } shttpParserState;
 
-static __attribute__((noinline)) bool shttp_parse_introduction(shttpParserState *state) {
-    char *data = state->request.bodyData;
-    uint16_t len = state->request.bodyLen;
-    uint16_t i; // parser index
-
-    // find method
-    if (strncmp("GET ", data, MIN(4, len)) == 0) {
-        state->method = shttpMethodGET;
-        i = 4;
-    } else
-    if (strncmp("POST ", data, MIN(5, len)) == 0) {
-        state->method = shttpMethodPOST;
-        i = 5;
-    } else
-    if (strncmp("PUT ", data, MIN(4, len)) == 0) {
-        state->method = shttpMethodPUT;
-        i = 4;
-    } else
-    if (strncmp("PATCH ", data, MIN(6, len)) == 0) {
-        state->method = shttpMethodPATCH;
-        i = 6;
-    } else
-    if (strncmp("DELETE ", data, MIN(7, len)) == 0) {
-        state->method = shttpMethodDELETE;
-        i = 7;
-    } else
-    if (strncmp("OPTIONS ", data, MIN(8, len)) == 0) {
-        state->method = shttpMethodOPTIONS;
-        i = 8;
-    } else
-    if (strncmp("HEAD ", data, MIN(5, len)) == 0) {
-        state->method = shttpMethodHEAD;
-        i = 5;
-    } else {
+static bool shttp_parser_resize(shttpParserState *state, uint16_t size) {
+    // path parameters are the only pointers into the buffer while parsing
+    uint16_t offsets[SHTTP_MAX_PATH_PARAMETERS];
+    for (uint8_t i = 0; i < state->request.numPathParameters; i++) {
+        offsets[i] = state->pathParameters[i] - state->buffer;
+    }
+
+    char *buffer = realloc(state->buffer, size);
+    if (buffer == NULL) {
+        LOG(ERROR, "shttp: Out of memory while resizing buffer to %d bytes", size);
         return false;
     }
 
-    LOG(TRACE, "shttp: parser -> method: %d", state->method);
+    state->buffer = buffer;
+    state->bufferSize = size;
+    for (uint8_t i = 0; i < state->request.numPathParameters; i++) {
+        state->pathParameters[i] = buffer + offsets[i];
+    }
+    return true;
+}
 
-    // get path until the ? (if there is one)
-    bool parameters = false;
+static void shttp_add_parameter(shttpParserState *state, uint16_t keyStart, uint16_t keyEnd, uint16_t valueStart, uint16_t valueEnd) {
+    if (state->request.numParameters >= SHTTP_MAX_PARAMETERS) {
+        LOG(WARN, "shttp: Too many URL parameters, dropping");
+        return;
+    }
 
-    state->path = malloc(len - i);
-    char *buf = state->path;
-    for(; i < len; i++) {
-        if ((data[i] != '?') && (data[i] != ' ')) {
-            *buf++ = data[i];
-        } else {
-            if (data[i] == '?') {
-                parameters = true;
-            }
+    // decoding only shrinks, so key and value are decoded in place
+    // and zero terminated on their delimiter
+    uint16_t keyLen = shttp_url_decode_inplace(state->buffer + keyStart, keyEnd - keyStart);
+    shttpKeyValueView *view = &state->parameterViews[state->request.numParameters++];
+    view->name = (shttpView){ keyStart, keyLen };
+    if (valueStart == valueEnd) {
+        // no value, point to the terminator of the key
+        view->value = (shttpView){ keyStart + keyLen, 0 };
+    } else {
+        uint16_t valueLen = shttp_url_decode_inplace(state->buffer + valueStart, valueEnd - valueStart);
+        view->value = (shttpView){ valueStart, valueLen };
+    }
+
+    LOG(TRACE, "shttp: parser parameter -> '%s': '%s'", state->buffer + view->name.offset, state->buffer + view->value.offset);
+}
+
+static shttpMethod shttp_parse_method(const char *data, uint16_t len) {
+    switch (len) {
+        case 3:
+            if (memcmp("GET", data, 3) == 0) return shttpMethodGET;
+            if (memcmp("PUT", data, 3) == 0) return shttpMethodPUT;
             break;
-        }
+        case 4:
+            if (memcmp("POST", data, 4) == 0) return shttpMethodPOST;
+            if (memcmp("HEAD", data, 4) == 0) return shttpMethodHEAD;
+            break;
+        case 5:
+            if (memcmp("PATCH", data, 5) == 0) return shttpMethodPATCH;
+            break;
+        case 6:
+            if (memcmp("DELETE", data, 6) == 0) return shttpMethodDELETE;
+            break;
+        case 7:
+            if (memcmp("OPTIONS", data, 7) == 0) return shttpMethodOPTIONS;
+            break;
+    }
+    return 0;
+}
+
+// returns which known header a lower case name is, SHTTP_HDR_COUNT for other headers
+static shttpKnownHeader shttp_known_header(const char *name, uint16_t len) {
+    // the known names all differ in length, one compare is enough
+    static const char *const names[] = {
+        "host", "content-length", "content-type", "accept-encoding",
+        "if-none-match", "connection", "upgrade", "accept",
+        "sec-websocket-key", "sec-websocket-version"
+    };
+    shttpKnownHeader header;
+    switch (len) {
+        case 4:  header = SHTTP_HDR_HOST; break;
+        case 14: header = SHTTP_HDR_CONTENT_LENGTH; break;
+        case 12: header = SHTTP_HDR_CONTENT_TYPE; break;
+        case 15: header = SHTTP_HDR_ACCEPT_ENCODING; break;
+        case 13: header = SHTTP_HDR_IF_NONE_MATCH; break;
+        case 10: header = SHTTP_HDR_CONNECTION; break;
+        case 7:  header = SHTTP_HDR_UPGRADE; break;
+        case 6:  header = SHTTP_HDR_ACCEPT; break;
+        case 17: header = SHTTP_HDR_SEC_WEBSOCKET_KEY; break;
+        case 21: header = SHTTP_HDR_SEC_WEBSOCKET_VERSION; break;
+        default: return SHTTP_HDR_COUNT;
+    }
+    return (memcmp(names[header], name, len) == 0) ? header : SHTTP_HDR_COUNT;
+}
+
+// a header line is complete, name and value are terminated in place
+static void shttp_add_header(shttpParserState *state, uint16_t nameEnd, uint16_t valueEnd) {
+    char *data = state->buffer;
+    uint16_t nameStart = state->tokenStart;
+    uint16_t valueStart = state->valueStart;
+
+    // value without surrounding whitespace
+    if (valueStart == 0) {
+        valueStart = valueEnd;
+    }
+    while ((valueEnd > valueStart) && ((data[valueEnd - 1] == ' ') || (data[valueEnd - 1] == '\t'))) {
+        valueEnd--;
     }
-    *buf++ = '\0';
+    data[valueEnd] = '\0';
 
-    LOG(TRACE, "shttp: parser -> path: '%s'", state->path);
+    char *name = data + nameStart;
+    char *value = data + valueStart;
+    uint16_t nameLen = nameEnd - nameStart;
 
-    // read parameters
-    if (parameters) {
-        uint16_t keyStart = i;
-        uint16_t valueStart = 0;
-        for(; i < len; i++) {
-            if (data[i] == '=') {
-                // key ended, value started
-                valueStart = i + 1;
+    LOG(TRACE, "shttp: parser -> header: '%s: %s'", name, value);
+
+    if (state->request.numHeaders < SHTTP_MAX_HEADERS) {
+        state->headerViews[state->request.numHeaders++] = (shttpKeyValueView){
+            { nameStart, nameLen },
+            { valueStart, valueEnd - valueStart }
+        };
+    } else {
+        LOG(WARN, "shttp: Too many headers, dropping '%s'", name);
+    }
+
+    shttpKnownHeader known = shttp_known_header(name, nameLen);
+    if (known == SHTTP_HDR_COUNT) {
+        return;
+    }
+    state->knownHeaderOffsets[known] = valueStart;
+
+    // handle special headers directly
+    switch (known) {
+        case SHTTP_HDR_CONTENT_LENGTH:
+            state->expectedBodySize = atoi(value);
+            break;
+        case SHTTP_HDR_CONNECTION:
+            if (strcasecmp("close", value) == 0) {
+                state->keepAlive = false;
+            } else if (strcasecmp("keep-alive", value) == 0) {
+                state->keepAlive = true;
             }
-            if ((data[i] == '&') || (data[i] == ' ')) {
-                // if we find an ampersand or a space the value ended
-                // key = keyStart -> valueStart - 2
-                // value = valueStart -> i - 1
-
-                // at first check if we have to re-alloc the parameter list
-                if (state->allocatedParameters < state->request.numParameters + 1) {
-                    state->request.parameters = realloc(state->request.parameters, sizeof(shttpParameter) * (state->allocatedParameters + 1));
-                    if (state->request.parameters == NULL) {
-                        state->request.numParameters = 0;
-                        state->allocatedParameters = 0;
-                        LOG(ERROR, "shttp: Out of memory while parsing intro");
+            break;
+        default:
+            break;
+    }
+}
+
+// end of a line, excluding the carriage return in front of the line feed at `i`
+static uint16_t shttp_line_end(shttpParserState *state, uint16_t start, uint16_t i) {
+    if ((i > start) && (state->buffer[i - 1] == '\r')) {
+        return i - 1;
+    }
+    return i;
+}
+
+// returns the offset in front of the next line feed or the last byte received
+static uint16_t shttp_skip_line(shttpParserState *state, uint16_t i) {
+    char *lineFeed = memchr(state->buffer + i, '\n', state->bufferLen - i);
+    if (lineFeed == NULL) {
+        return state->bufferLen - 1;
+    }
+    return lineFeed - state->buffer - 1;
+}
+
+// runs the state machine over the bytes received since the last call,
+// each byte is looked at once. Returns false on a parse error
+static bool shttp_parse_head(shttpParserState *state) {
+    char *data = state->buffer;
+    uint16_t i;
+
+    for (i = state->parsePosition; (i < state->bufferLen) && (state->step != shttpParseBody); i++) {
+        char c = data[i];
+
+        switch (state->step) {
+            case shttpParseMethod:
+                if (((c == '\r') || (c == '\n')) && (i == state->tokenStart)) {
+                    // empty lines in front of the request line are ignored (RFC 9112, 2.2)
+                    state->tokenStart = i + 1;
+                    break;
+                }
+                if (c != ' ') {
+                    if (i - state->tokenStart >= 7) {
                         return false;
                     }
+                    break;
+                }
+                state->method = shttp_parse_method(data + state->tokenStart, i - state->tokenStart);
+                if (state->method == 0) {
+                    return false;
+                }
+                LOG(TRACE, "shttp: parser -> method: %d", state->method);
+                state->tokenStart = i + 1;
+                state->step = shttpParseTarget;
+                break;
 
-                    state->allocatedParameters++;
+            case shttpParseTarget:
+                // path until the ? (if there is one)
+                if ((c == '\r') || (c == '\n')) {
+                    return false;
                 }
-                
-                uint8_t tmpLen;
-                
-                // copy key
-                tmpLen = (valueStart - 2) - keyStart;
-                char *name = shttp_url_decode_buffer(data + keyStart, tmpLen);
+                if ((c != '?') && (c != ' ')) {
+                    break;
+                }
+                state->path = (shttpView){ state->tokenStart, i - state->tokenStart };
+                data[i] = '\0';
+                LOG(TRACE, "shttp: parser -> path: '%s'", data + state->path.offset);
 
-                // copy value
-                tmpLen = (i - 1) - valueStart;
-                char *value = shttp_url_decode_buffer(data + valueStart, tmpLen);
+                state->tokenStart = i + 1;
+                state->valueStart = 0;
+                state->step = (c == '?') ? shttpParseQuery : shttpParseVersion;
+                break;
 
-                LOG(TRACE, "shttp: parser parameter -> '%s': '%s'", name, value);
+            case shttpParseQuery:
+                // key and value end at '&' or the space in front of the version
+                if ((c == '\r') || (c == '\n')) {
+                    return false;
+                }
+                if ((c == '=') && (state->valueStart == 0)) {
+                    state->valueStart = i + 1;
+                    break;
+                }
+                if ((c != '&') && (c != ' ')) {
+                    break;
+                }
+                if (state->valueStart == 0) {
+                    if (i > state->tokenStart) {
+                        shttp_add_parameter(state, state->tokenStart, i, i, i);
+                    }
+                } else if (state->valueStart - 1 > state->tokenStart) {
+                    shttp_add_parameter(state, state->tokenStart, state->valueStart - 1, state->valueStart, i);
+                }
+                state->tokenStart = i + 1;
+                state->valueStart = 0;
+                if (c == ' ') {
+                    // this means the end of the parameter list
+                    state->step = shttpParseVersion;
+                }
+                break;
 
-                // now append the new parameter
-                state->request.parameters[state->request.numParameters] = (shttpParameter){ name, value };
+            case shttpParseVersion:
+                if (c != '\n') {
+                    // nothing to do before the line feed, skip ahead
+                    i = shttp_skip_line(state, i);
+                    break;
+                }
+                // HTTP/1.1 defaults to persistent connections, HTTP/1.0 has to ask for it
+                if ((shttp_line_end(state, state->tokenStart, i) - state->tokenStart == 8) &&
+                    (memcmp("HTTP/1.0", data + state->tokenStart, 8) == 0)) {
+                    state->keepAlive = false;
+                    state->http10 = true;
+                }
+                state->tokenStart = i + 1;
+                state->step = shttpParseHeaderName;
+                break;
 
-                // increment the param count
-                state->request.numParameters++;
+            case shttpParseHeaderName:
+                if (c == ':') {
+                    if (i == state->tokenStart) {
+                        return false;
+                    }
+                    data[i] = '\0';
+                    state->nameEnd = i;
+                    state->valueStart = 0;
+                    state->step = shttpParseHeaderValue;
+                    break;
+                }
+                if (c == '\n') {
+                    if (shttp_line_end(state, state->tokenStart, i) != state->tokenStart) {
+                        // Only a key without a value? Parse error!
+                        return false;
+                    }
+                    // empty line, end of header block
+                    state->headerLen = i + 1;
+                    state->step = shttpParseBody;
+                    break;
+                }
+                // header names are case insensitive, lower case them in place
+                data[i] = tolower((unsigned char)c);
+                break;
 
-                // set next key start to next char
-                keyStart = i + 1;
-                valueStart = 0;
-            }
-            if (data[i] == ' ') {
-                // this means the end of the parameter list
+            case shttpParseHeaderValue:
+                if (c == '\n') {
+                    shttp_add_header(state, state->nameEnd, shttp_line_end(state, state->nameEnd, i));
+                    state->tokenStart = i + 1;
+                    state->step = shttpParseHeaderName;
+                    break;
+                }
+                // skip whitespace in front of the value
+                if ((state->valueStart == 0) && (c != ' ') && (c != '\t')) {
+                    state->valueStart = i;
+                }
+                if (state->valueStart != 0) {
+                    i = shttp_skip_line(state, i);
+                }
                 break;
-            }
-        }
-    }
 
-    // find line break, move data in buffer and shrink buffer
-    for(; i < len - 1; i++) {
-        if ((data[i] == '\r') && (data[i + 1] == '\n')) {
-            uint16_t newLen = state->request.bodyLen - i - 2;
-            LOG(TRACE, "shttp: http request intro consumed %d bytes", state->request.bodyLen - newLen);
-            memmove(state->request.bodyData, state->request.bodyData + i + 2, newLen);
-            state->request.bodyData = realloc(state->request.bodyData, newLen);
-            state->request.bodyLen = newLen;
-            state->introductionFinished = true;
-            break;
+            case shttpParseBody:
+                break;
         }
     }
 
+    state->parsePosition = i;
     return true;
 }
 
-static __attribute__((noinline)) bool shttp_parse_headers(shttpParserState *state) {
-    char *data = state->request.bodyData;
-    uint16_t len = state->request.bodyLen;
-    uint16_t keyStart = UINT16_MAX;
-    uint16_t valueStart = UINT16_MAX;
+// turn the views into pointers for the route, the buffer does not move anymore
+static void shttp_parser_bind_request(shttpParserState *state) {
+    char *data = state->buffer;
 
-    if (len < 5) {
+    for (uint8_t i = 0; i < state->request.numHeaders; i++) {
+        state->headers[i] = (shttpHeader){
+            data + state->headerViews[i].name.offset,
+            data + state->headerViews[i].value.offset
+        };
+    }
+    for (uint8_t i = 0; i < SHTTP_HDR_COUNT; i++) {
+        uint16_t offset = state->knownHeaderOffsets[i];
+        state->request.knownHeaders[i] = (offset != 0) ? data + offset : NULL;
+    }
+    for (uint8_t i = 0; i < state->request.numParameters; i++) {
+        state->parameters[i] = (shttpParameter){
+            data + state->parameterViews[i].name.offset,
+            data + state->parameterViews[i].value.offset
+        };
+    }
+
+    state->request.contentLength = state->expectedBodySize;
+}
+
+// false if the Host header names another host. Addresses and localhost
+// are fine, the device is reachable by those as well
+static bool shttp_parser_host_valid(shttpParserState *state) {
+    const char *hostName = shttpServerConfig->hostName;
+    uint16_t offset = state->knownHeaderOffsets[SHTTP_HDR_HOST];
+    if ((hostName == NULL) || (offset == 0)) {
         return true;
     }
 
-    // split out headers
-    for(uint16_t i = 0; i < len - 1; i++) {
-        // if we find a ':' and have not already started the value
-        // we start the value at the first non-whitespace char after
-        // the ':'
-        if ((data[i] == ':') && (valueStart == UINT16_MAX)) {
-            // skip over whitespace
-            for (uint16_t j = i + 1; j < len; j++) {
-                if ((data[j] != ' ') && (data[j] != '\t')) {
-                    valueStart = j;
-                    break;
-                }
-            }
-            continue;
-        } else if ((keyStart == UINT16_MAX) && (data[i] != '\r') && (data[i] != '\n')) {
-            keyStart = i;
+    // compare without the port
+    char *host = state->buffer + offset;
+    uint16_t len = strcspn(host, ":");
+    if ((host[0] == '[') || (strspn(host, "0123456789.") == len) || ((len == 9) && (strncasecmp("localhost", host, 9) == 0))) {
+        return true;
+    }
+    return (strlen(hostName) == len) && (strncasecmp(hostName, host, len) == 0);
+}
+
+// check the request once the headers are complete and size the buffer for
+// the body. Returns shttpStatusOK or the status to reject the request with,
+// shttpStatusNotFound if no route matched
+static shttpStatusCode shttp_parser_finish_headers(shttpParserState *state) {
+    if (!shttp_parser_host_valid(state)) {
+        return shttpStatusMisdirectedRequest;
+    }
+
+    state->route = shttp_find_route(state->buffer + state->path.offset, state->method, &state->request, &state->allowedMethods);
+    if (state->route == NULL) {
+        return shttpStatusNotFound;
+    }
+
+    uint16_t size;
+    if (state->route->bodyCallback != NULL) {
+        // streaming route, the body passes through in recv sized parts
+        size = state->headerLen + MIN(state->expectedBodySize, SHTTP_MAX_RECV_BUFFER) + 1;
+    } else {
+        // exactly the declared body plus the terminator
+        if (state->expectedBodySize > SHTTP_MAX_BODY_SIZE) {
+            return shttpStatusPayloadTooLarge;
         }
+        size = state->headerLen + state->expectedBodySize + 1;
+    }
+    if ((size > state->bufferSize) && (!shttp_parser_resize(state, size))) {
+        return shttpStatusInternalError;
+    }
 
-        // line break so header line is finished
-        if ((data[i] == '\r') && (data[i + 1] == '\n')) {
-            // no k/v pair in this line -> end of header block, shrink buffer
-            if ((keyStart == UINT16_MAX) && (valueStart == UINT16_MAX)) {
-                uint16_t newLen = state->request.bodyLen - i - 2;
-                memmove(state->request.bodyData, state->request.bodyData + i + 2, newLen);
-                state->request.bodyData = realloc(state->request.bodyData, newLen + 1);
-                state->request.bodyData[newLen] = '\0'; // zero terminate to be sure
-                state->request.bodyLen = newLen;
-                state->headerFinished = true;
-                return true;
-            }
-            if (valueStart == UINT16_MAX) {
-                // Only a key without a value? Parse error!
-                return false;
-            }
+    shttp_parser_bind_request(state);
+    return shttpStatusOK;
+}
 
-            // at first check if we have to re-alloc the header list
-            if (state->allocatedHeaders < state->request.numHeaders + 1) {
-                state->request.headers = realloc(state->request.headers, sizeof(shttpHeader) * (state->allocatedHeaders + 1));
-                if (state->request.headers == NULL) {
-                    state->request.numHeaders = 0;
-                    state->allocatedHeaders = 0;
-                    LOG(ERROR, "shttp: Out of memory while parsing headers");
-                    return false;
-                }
+// count the request, returns how many requests may follow on this connection
+static uint8_t shttp_parser_keep_alive(shttpParserState *state, bool reusable) {
+    state->requestCount++;
+    if ((state->keepAlive) && (reusable) && (state->requestCount < SHTTP_KEEPALIVE_MAX_REQUESTS)) {
+        return SHTTP_KEEPALIVE_MAX_REQUESTS - state->requestCount;
+    }
+    return 0;
+}
 
-                state->allocatedHeaders++;
-            }
-            
-            uint8_t tmpLen;
-            
-            // copy key
-            tmpLen = (valueStart - 1) - keyStart;
-            char *name = malloc(tmpLen + 1);
-            memcpy(name, data + keyStart, tmpLen);
-            for (uint8_t j = 0; j < tmpLen; j++) {
-                name[j] = tolower(name[j]);
-            }
-            name[tmpLen - 1] = '\0';
+// answer a request that can not be served right after its headers. The
+// body is dropped while it arrives, if it is too big to wait for the
+// connection is closed instead
+static shttpConnectionState shttp_parser_reject(shttpParserState *state, shttpStatusCode status, int socket) {
+    LOG(DEBUG, "shttp: rejecting request with %d before the body", status);
+    state->rejected = true;
+
+    uint8_t keepAlive = shttp_parser_keep_alive(state, state->expectedBodySize <= SHTTP_MAX_BODY_SIZE);
+    if (status == shttpStatusNotFound) {
+        // the router knows if it is a 404 or 405
+        return shttp_exec_route(NULL, state->allowedMethods, &state->request, &state->timing, socket, keepAlive, !state->http10, state->staticChunk);
+    }
+    state->timing.handler = state->timing.handled = shttp_metrics_now();
+    return shttp_send_response(NULL, &state->timing, shttp_empty_response(status), socket, keepAlive, !state->http10, state->staticChunk);
+}
+
+// hand received body bytes to a streaming route (or nobody if the request
+// was rejected) and drop them from the buffer
+static void shttp_parser_stream_body(shttpParserState *state) {
+    uint16_t len = MIN(state->bufferLen - state->headerLen, state->expectedBodySize - state->request.bodyReceived);
+    if (len == 0) {
+        return;
+    }
+
+    // the route is called synchronously, nothing is received meanwhile
+    // so a slow route throttles the client through the TCP window
+    if ((!state->rejected) && (!state->route->bodyCallback(&state->request, state->buffer + state->headerLen, len, state->route->userData))) {
+        LOG(DEBUG, "shttp: route stopped receiving the body");
+        state->streamAborted = true;
+    }
+    state->request.bodyReceived += len;
 
-            // copy value
-            tmpLen = (i + 1) - valueStart;
-            char *value = malloc(tmpLen + 1);
-            memcpy(value, data + valueStart, tmpLen);
-            value[tmpLen - 1] = '\0';
-        
-            LOG(TRACE, "shttp: parser -> header: '%s: %s'", name, value);
+    // bytes after the body belong to the next request
+    memmove(state->buffer + state->headerLen, state->buffer + state->headerLen + len, state->bufferLen - state->headerLen - len);
+    state->bufferLen -= len;
+}
 
-            // now append the new parameter
-            state->request.headers[state->request.numHeaders] = (shttpHeader){ name, value };
+// forget the request, the first `keep` bytes of the buffer are the start of the next one
+static void shttp_parser_reset_request(shttpParserState *state, uint16_t keep) {
+    if (state->request.cleanupCallback != NULL) {
+        state->request.cleanupCallback(state->request.userData);
+    }
+    state->request.userData = NULL;
+    state->request.cleanupCallback = NULL;
+
+    // nothing else to free, everything lives in the connection buffer or the arena
+    shttp_arena_reset(&state->arena);
+    state->request.numHeaders = 0;
+    memset(state->knownHeaderOffsets, 0, sizeof(state->knownHeaderOffsets));
+    memset(state->request.knownHeaders, 0, sizeof(state->request.knownHeaders));
+    state->request.numParameters = 0;
+    state->request.numPathParameters = 0;
+    state->request.bodyData = NULL;
+    state->request.bodyLen = 0;
+    state->request.contentLength = 0;
+    state->request.bodyReceived = 0;
+    state->timing = (shttpRequestTiming){ 0 };
+
+    // give back memory a big request needed
+    if ((state->bufferSize > SHTTP_MAX_RECV_BUFFER) && (keep < SHTTP_MAX_RECV_BUFFER)) {
+        shttp_parser_resize(state, SHTTP_MAX_RECV_BUFFER);
+    }
+    state->bufferLen = keep;
+
+    state->step = shttpParseMethod;
+    state->parsePosition = 0;
+    state->tokenStart = 0;
+    state->valueStart = 0;
+    state->nameEnd = 0;
+    state->headerLen = 0;
+    state->expectedBodySize = 0;
+    state->route = NULL;
+    state->allowedMethods = 0;
+    state->streamAborted = false;
+    state->rejected = false;
+    state->keepAlive = true;
+    state->http10 = false;
+}
 
-            // increment the param count
-            state->request.numHeaders++;
+// drop the request ending at `requestEnd` from the buffer, anything after it
+// moves to the start. Returns the number of bytes left
+static uint16_t shttp_parser_consume(shttpParserState *state, uint16_t requestEnd) {
+    uint16_t leftover = state->bufferLen - requestEnd;
+    memmove(state->buffer, state->buffer + requestEnd, leftover);
+    return leftover;
+}
 
-            // handle special headers directly
-            if ((strlen(name) == 14) && (strcmp("content-length", name) == 0)) {
-                state->expectedBodySize = atoi(value);
-            }
-            if ((shttpServerConfig->hostName != NULL) && (strlen(name) == 4) && (strcmp("host", name) == 0)) {
-                if (strcmp(shttpServerConfig->hostName, value) != 0) {
-                    // FIXME: wrong host return a response immediately                        
-                }
-            }
+// hand complete frames to the WebSocket and keep the rest for the next recv
+static shttpConnectionState shttp_parser_websocket(shttpParserState *state) {
+    uint32_t frameSize;
+    shttpConnectionState result;
+    uint16_t used = shttp_websocket_parse(&state->websocket, state->buffer, state->bufferLen, &frameSize, &result);
+    if (result != shttpConnectionKeepAlive) {
+        return result;
+    }
 
-            // reset starting positions
-            keyStart = UINT16_MAX;
-            valueStart = UINT16_MAX;
-        }
+    memmove(state->buffer, state->buffer + used, state->bufferLen - used);
+    state->bufferLen -= used;
+
+    // the payload is zero terminated for the callback, keep a spare byte
+    if ((frameSize + 1 > state->bufferSize) && (!shttp_parser_resize(state, frameSize + 1))) {
+        return shttpConnectionClose;
     }
+    return shttpConnectionKeepAlive;
+}
 
-    return true; // await more data
+// make sure there is room for the rest of the header block, returns false if it is too big
+static bool shttp_parser_reserve(shttpParserState *state) {
+    if (state->bufferLen + 1 < state->bufferSize) {
+        return true;
+    }
+    if (state->bufferSize >= SHTTP_MAX_BODY_SIZE) {
+        return false;
+    }
+    return shttp_parser_resize(state, MIN(state->bufferSize * 2, SHTTP_MAX_BODY_SIZE));
 }
 
 
@@ -272,147 +611,225 @@ static __attribute__((noinline)) bool shttp_parse_headers(shttpParserState *stat
 // API
 //
 
-shttpParserState *shttp_parser_init_state(void) {
+shttpParserState *shttp_parser_init_state(uint32_t *staticChunk) {
     shttpParserState *result = malloc(sizeof(shttpParserState));
-    result->introductionFinished = false;
-    result->headerFinished = false;
-    result->expectedBodySize = 0;
-    
-    result->request.numHeaders = 0;
-    result->allocatedHeaders = 5;
-    result->request.headers = malloc(5 * sizeof(shttpHeader));
-    
-    result->request.numParameters = 0;
-    result->allocatedParameters = 0;
-    result->request.parameters = NULL;
-
-    result->request.numPathParameters = 0;
-    result->request.pathParameters = NULL;
-
-    result->request.bodyData = NULL;
-    result->request.bodyLen = 0;
+    if (result == NULL) {
+        return NULL;
+    }
+
+    // the connection buffer is allocated up front, the arena on first use
+    result->buffer = malloc(SHTTP_MAX_RECV_BUFFER);
+    if (result->buffer == NULL) {
+        free(result);
+        return NULL;
+    }
+    result->bufferSize = SHTTP_MAX_RECV_BUFFER;
+
+    result->request.headers = result->headers;
+    result->request.parameters = result->parameters;
+    result->request.pathParameters = result->pathParameters;
+
+    result->staticChunk = staticChunk;
+    result->arena = (shttpArena){ NULL, 0 };
+    result->request.arena = &result->arena;
+    result->request.cleanupCallback = NULL;
+    result->websocket.callback = NULL;
+
+    shttp_parser_reset(result);
 
     return result;
 }
 
-bool shttp_parse(shttpParserState *state, char *buffer, uint16_t len, int socket) {
-    bool result = true;
+char *shttp_parser_buffer(shttpParserState *state, uint16_t *len) {
+    // keep one byte to zero terminate the body
+    *len = state->bufferSize - state->bufferLen - 1;
+    return state->buffer + state->bufferLen;
+}
 
-    if (state->request.bodyData) {
-        // realloc internalized buffer to contain buffer
-        if (state->request.bodyLen + len > SHTTP_MAX_BODY_SIZE) {
-            LOG(ERROR, "shttp: HTTP request too long");
-            shttp_write_response(shttp_empty_response(shttpStatusBadRequest), socket);
-            return false;
-        }
-        state->request.bodyData = realloc(state->request.bodyData, state->request.bodyLen + len);
-    } else {
-        // create internalized buffer
-        state->request.bodyData = malloc(len);
+// parse the request at the start of the buffer, `finished` is set if a
+// response has been sent and the buffer holds what came after the request
+static shttpConnectionState shttp_parse_request(shttpParserState *state, int socket, bool *finished) {
+    *finished = false;
+    if (state->websocket.callback != NULL) {
+        return shttp_parser_websocket(state);
     }
-    if (!state->request.bodyData) {
-        LOG(ERROR, "shttp: Out of memory while building buffer");
-        return false;
-    }
-
-    // copy buffer to internal buffer
-    LOG(TRACE, "shttp: received %d bytes, appending to %d in buffer", len, state->request.bodyLen);
-    memcpy(state->request.bodyData + state->request.bodyLen, buffer, len);
-    state->request.bodyLen += len;
 
-    while(1) {
-        LOG(TRACE, "shttp: parser loop entered, %d bytes left (intro: %d, headers: %d)", state->request.bodyLen, state->introductionFinished, state->headerFinished);
+    if (state->step != shttpParseBody) {
+        // following requests are timed from their first byte, the first
+        // one of a connection from the accept (see shttp_parser_start)
+        if (state->timing.start == 0) {
+            state->timing.start = shttp_metrics_now();
+        }
 
-        // check if we are in header or body mode
-        if ((!state->introductionFinished) || (!state->headerFinished)) {
-            // check if we have a \r\n in the buffer
-            char *data = state->request.bodyData;
-            for (uint16_t i = 0; i < state->request.bodyLen - 1; i++) {
-                if ((data[i] == '\r') && (data[i + 1] == '\n')) {
+        if (!shttp_parse_head(state)) {
+            // parse error
+            return shttpConnectionClose;
+        }
 
-                    // line break found, try to parse the stuff
-                    if (!state->introductionFinished) {
-                        result = shttp_parse_introduction(state);
-                        break;
-                    }
-                    if (!state->headerFinished) {
-                        result = shttp_parse_headers(state);
-                        break;
-                    }
-                }
+        if (state->step != shttpParseBody) {
+            if (!shttp_parser_reserve(state)) {
+                LOG(ERROR, "shttp: HTTP request header too long");
+                state->timing.parsed = state->timing.handler = state->timing.handled = shttp_metrics_now();
+                state->timing.bytesIn = state->bufferLen;
+                shttp_send_response(NULL, &state->timing, shttp_empty_response(shttpStatusBadRequest), socket, 0, false, state->staticChunk);
+                return shttpConnectionClose;
             }
-            if (!result) {
-                // parse error
-                return false;
+
+            // await more data
+            LOG(TRACE, "shttp: parser -> waiting for more data, headers not finished");
+            return shttpConnectionKeepAlive;
+        }
+
+        state->timing.parsed = shttp_metrics_now();
+        state->timing.bytesIn = state->headerLen;
+
+        // decide what happens before any of the body is buffered
+        shttpStatusCode status = shttp_parser_finish_headers(state);
+        if (status != shttpStatusOK) {
+            shttpConnectionState result = shttp_parser_reject(state, status, socket);
+            if (result != shttpConnectionKeepAlive) {
+                return result;
             }
-            continue;
         }
+    }
 
-        // if headers have finished, check if body size reached
-        if (state->headerFinished) {
-            if (state->request.bodyLen >= state->expectedBodySize) {
-                // yeah we have everything, execute the route
-                LOG(TRACE, "shttp: parser -> expected body size reached: %d/%d", state->request.bodyLen, state->expectedBodySize);
+    // check if body size reached
+    if ((state->rejected) || (state->route->bodyCallback != NULL)) {
+        shttp_parser_stream_body(state);
+        if ((state->request.bodyReceived < state->expectedBodySize) && (!state->streamAborted)) {
+            return shttpConnectionKeepAlive;
+        }
 
-                // run the callback
-                shttp_exec_route(state->path, state->method, &state->request, socket);
+        if (state->rejected) {
+            // already answered, go on with the next request
+            shttp_parser_reset_request(state, shttp_parser_consume(state, state->headerLen));
+            *finished = true;
+            return shttpConnectionKeepAlive;
+        }
 
-                // we operate in 'Connection: close' mode always
-                return false;
-            }
+        // the body has been consumed by the route
+        state->request.bodyData = state->buffer + state->headerLen;
+        state->request.bodyLen = 0;
+    } else {
+        if (state->bufferLen - state->headerLen < state->expectedBodySize) {
             LOG(TRACE, "shttp: parser -> waiting for more data");
-            break;
-        } else {
-            if (state->request.bodyLen < 5) {
-                LOG(TRACE, "shttp: parser -> waiting for more data, headers not finished");
-                break;
-            }
+            return shttpConnectionKeepAlive;
         }
+
+        // there is always a spare byte to zero terminate the body
+        state->request.bodyData = state->buffer + state->headerLen;
+        state->request.bodyLen = state->expectedBodySize;
     }
 
-    // await more data
-    return true;
-}
+    // the byte after the body may be the start of the next request
+    char *bodyEnd = state->request.bodyData + state->request.bodyLen;
+    char next = *bodyEnd;
+    *bodyEnd = '\0';
 
-void shttp_destroy_parser(shttpParserState *state) {
-    LOG(TRACE, "shttp: parser -> destroy");
+    // yeah we have everything, execute the route
+    LOG(TRACE, "shttp: parser -> expected body size reached: %d", state->expectedBodySize);
 
-    // free headers
-    if (state->request.headers != NULL) {
-        for(uint8_t i = 0; i < state->request.numHeaders; i++) {
-            free(state->request.headers[i].name);
-            free(state->request.headers[i].value);
-        }
-        free(state->request.headers);
+    // the rest of an aborted body is still on the way, so close after the response
+    uint8_t keepAlive = shttp_parser_keep_alive(state, !state->streamAborted);
+
+    // run the callback
+    state->timing.bytesIn += (state->route->bodyCallback != NULL) ? state->request.bodyReceived : state->expectedBodySize;
+    shttpConnectionState result = shttp_exec_route(state->route, state->allowedMethods, &state->request, &state->timing, socket, keepAlive, !state->http10, state->staticChunk);
+    *bodyEnd = next;
+
+    // a streaming route has consumed its body already
+    uint16_t requestEnd = state->headerLen;
+    if (state->route->bodyCallback == NULL) {
+        requestEnd += state->expectedBodySize;
     }
+    uint16_t leftover = shttp_parser_consume(state, requestEnd);
 
-    // free parameters
-    if (state->request.parameters != NULL) {
-        for(uint8_t i = 0; i < state->request.numParameters; i++) {
-            free(state->request.parameters[i].name);
-            free(state->request.parameters[i].value);
+    if (result == shttpConnectionUpgraded) {
+        // from now on the connection talks WebSocket
+        if (state->route->websocketCallback == NULL) {
+            return shttpConnectionClose;
         }
-        free(state->request.parameters);
+        // the connection keeps the WebSocket the handshake counted
+        state->request.cleanupCallback = NULL;
+        state->websocket = (shttpWebSocket){ socket, state->route->websocketCallback, state->route->userData, false };
+        shttp_parser_reset_request(state, leftover);
+        *finished = true;
+        return shttpConnectionKeepAlive;
+    }
+    if (result != shttpConnectionKeepAlive) {
+        return result;
     }
 
-    // free path parameters
-    if (state->request.pathParameters != NULL) {
-        for(uint8_t i = 0; i < state->request.numPathParameters; i++) {
-            free(state->request.pathParameters[i]);
-        }
-        free(state->request.pathParameters);
+    // connection stays open, get ready for the next request
+    shttp_parser_reset_request(state, leftover);
+    *finished = true;
+    return shttpConnectionKeepAlive;
+}
+
+shttpConnectionState shttp_parse(shttpParserState *state, uint16_t len, int socket) {
+    LOG(TRACE, "shttp: received %d bytes, appending to %d in buffer", len, state->bufferLen);
+    state->bufferLen += len;
+
+    // a client may send the next requests without waiting for the response,
+    // they are answered in order
+    bool finished;
+    shttpConnectionState result;
+    do {
+        result = shttp_parse_request(state, socket, &finished);
+    } while ((result == shttpConnectionKeepAlive) && (finished) && (state->bufferLen > 0));
+
+    return result;
+}
+
+char *shttp_request_header(shttpRequest *request, shttpKnownHeader header) {
+    if (header >= SHTTP_HDR_COUNT) {
+        return NULL;
+    }
+    return request->knownHeaders[header];
+}
+
+void shttp_parser_start(shttpParserState *state, uint32_t accepted) {
+    state->timing.start = accepted;
+}
+
+bool shttp_parser_park(shttpParserState *state, shttpParkedState *parked) {
+    if ((state->step != shttpParseMethod) || (state->bufferLen > 0)) {
+        return false;
     }
+    parked->requestCount = state->requestCount;
+    parked->websocket = state->websocket;
+    state->websocket.callback = NULL;
+    return true;
+}
+
+void shttp_parser_resume(shttpParserState *state, shttpParkedState *parked) {
+    state->requestCount = parked->requestCount;
+    state->websocket = parked->websocket;
+}
+
+void shttp_parser_reset(shttpParserState *state) {
+    LOG(TRACE, "shttp: parser -> reset");
 
-    // free internal buffer
-    if (state->request.bodyData) {
-        free(state->request.bodyData);
+    shttp_parser_reset_request(state, 0);
+    state->requestCount = 0;
+    if (state->websocket.callback != NULL) {
+        shttp_websocket_release();
+        state->websocket.callback = NULL;
     }
+}
 
-    // free path
-    if (state->path) {
-        free(state->path);
+shttpConnectionState shttp_parser_idle(shttpParserState *state) {
+    if (state->websocket.callback != NULL) {
+        return shttp_websocket_idle(&state->websocket);
     }
+    return shttpConnectionClose;
+}
+
+void shttp_destroy_parser(shttpParserState *state) {
+    LOG(TRACE, "shttp: parser -> destroy");
 
-    // free state object
+    // free connection buffer, arena and state object
+    shttp_arena_destroy(&state->arena);
+    free(state->buffer);
     free(state);
-}
\ No newline at end of file
+}
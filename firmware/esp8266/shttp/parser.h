@@ -2,11 +2,49 @@
 #define shttp_parser_h_included
 
 #include "simplehttp/http.h"
+#include "response.h"
+#include "websocket.h"
 
 typedef struct _shttpParserState shttpParserState;
 
-shttpParserState *shttp_parser_init_state(void);
-bool shttp_parse(shttpParserState *state, char *buffer, uint16_t len, int socket);
+// `staticChunk` is a word aligned buffer of SHTTP_STATIC_CHUNK bytes the
+// responses send static data through. Parsers used by the same task may
+// share it
+shttpParserState *shttp_parser_init_state(uint32_t *staticChunk);
+
+// free space at the end of the connection buffer to receive data into
+char *shttp_parser_buffer(shttpParserState *state, uint16_t *len);
+
+// parse `len` bytes that have been received into the connection buffer,
+// returns what should happen to the connection
+shttpConnectionState shttp_parse(shttpParserState *state, uint16_t len, int socket);
+
+// the client did not send anything for SHTTP_IDLE_TIMEOUT, returns what
+// should happen to the connection
+shttpConnectionState shttp_parser_idle(shttpParserState *state);
+
+// a connection has been accepted at `accepted` (see shttp_metrics_now),
+// call before the first shttp_parse
+void shttp_parser_start(shttpParserState *state, uint32_t accepted);
+
+// what an idle connection keeps while it waits for its next request
+// without a parser (see shttp_parser_park)
+typedef struct _shttpParkedState {
+    uint8_t requestCount;
+
+    // the callback is NULL if the connection was not upgraded
+    shttpWebSocket websocket;
+} shttpParkedState;
+
+// true if the connection waits for its next request (or WebSocket frame)
+// and nothing of it has been received, `parked` is set to what has to be
+// kept then. The WebSocket moves to `parked`, resume or close it from there
+bool shttp_parser_park(shttpParserState *state, shttpParkedState *parked);
+
+// continue a parked connection, call after shttp_parser_start
+void shttp_parser_resume(shttpParserState *state, shttpParkedState *parked);
+
+void shttp_parser_reset(shttpParserState *state);
 void shttp_destroy_parser(shttpParserState *state);
 
 #endif /* shttp_parser_h_included */
\ No newline at end of file
@@ -11,122 +11,327 @@
 #include <errno.h>
 
 #include "debug.h"
+#include "response.h"
+#include "json.h"
+
+#ifndef MIN
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+#endif
+
+static const char *shttp_status_line(shttpStatusCode code) {
+    switch(code) {
+        case shttpStatusSwitchingProtocols:
+            return "HTTP/1.1 101 Switching protocols\r\n";
 
-void shttp_write_response(shttpResponse *response, int socket) {
-    char *responseIntro = NULL;
-    switch(response->responseCode) {
         case shttpStatusOK:
-            responseIntro = "200 Ok";
-            break;
+            return "HTTP/1.1 200 Ok\r\n";
         case shttpStatusCreated:
-            responseIntro = "201 Created";
-            break;
+            return "HTTP/1.1 201 Created\r\n";
         case shttpStatusAccepted:
-            responseIntro = "202 Accepted";
-            break;
+            return "HTTP/1.1 202 Accepted\r\n";
         case shttpStatusNoContent:
-            responseIntro = "204 No content";
-            break;
-    
+            return "HTTP/1.1 204 No content\r\n";
+
         case shttpStatusMovedPermanently:
-            responseIntro = "301 Redirect";
-            break;
+            return "HTTP/1.1 301 Redirect\r\n";
         case shttpStatusFound:
-            responseIntro = "302 Found";
-            break;
+            return "HTTP/1.1 302 Found\r\n";
         case shttpStatusNotModified:
-            responseIntro = "304 Not modified";
-            break;
+            return "HTTP/1.1 304 Not modified\r\n";
 
         case shttpStatusBadRequest:
-            responseIntro = "400 Bad request";
-            break;
+            return "HTTP/1.1 400 Bad request\r\n";
         case shttpStatusUnauthorized:
-            responseIntro = "401 Unauthorized";
-            break;
+            return "HTTP/1.1 401 Unauthorized\r\n";
         case shttpStatusForbidden:
-            responseIntro = "403 Forbidden Ok";
-            break;
+            return "HTTP/1.1 403 Forbidden Ok\r\n";
         case shttpStatusNotFound:
-            responseIntro = "404 Not found";
-            break;
+            return "HTTP/1.1 404 Not found\r\n";
+        case shttpStatusNotAllowed:
+            return "HTTP/1.1 405 Method not allowed\r\n";
         case shttpStatusNotAcceptable:
-            responseIntro = "406 Not acceptable";
-            break;
+            return "HTTP/1.1 406 Not acceptable\r\n";
         case shttpStatusConflict:
-            responseIntro = "409 Conflict";
-            break;
+            return "HTTP/1.1 409 Conflict\r\n";
+        case shttpStatusPayloadTooLarge:
+            return "HTTP/1.1 413 Payload too large\r\n";
         case shttpStatusRequestURITooLong:
-            responseIntro = "414 Request URI too long";
-            break;
+            return "HTTP/1.1 414 Request URI too long\r\n";
+        case shttpStatusMisdirectedRequest:
+            return "HTTP/1.1 421 Misdirected request\r\n";
+        case shttpStatusUpgradeRequired:
+            return "HTTP/1.1 426 Upgrade required\r\n";
 
         case shttpStatusInternalError:
-            responseIntro = "500 Internal server error";
-            break;
+            return "HTTP/1.1 500 Internal server error\r\n";
         case shttpStatusNotImplemented:
-            responseIntro = "501 Not implemented";
-            break;
+            return "HTTP/1.1 501 Not implemented\r\n";
         case shttpStatusBadGateway:
-            responseIntro = "502 Bad gateway";
-            break;
+            return "HTTP/1.1 502 Bad gateway\r\n";
         case shttpStatusServiceUnavailable:
-            responseIntro = "503 Service unavailable";
-            break;
+            return "HTTP/1.1 503 Service unavailable\r\n";
     }
 
-    LOG(TRACE, "shttp: sending response '%s'", responseIntro);
+    return "HTTP/1.1 500 Internal server error\r\n";
+}
 
-    // send status line
-    send(socket, "HTTP/1.1 ", 9, 0);
-    send(socket, responseIntro, strlen(responseIntro), 0);
-    send(socket, "\r\n", 2, 0);
+// send() may be interrupted or write only a part
+bool shttp_send_all(int socket, const char *data, uint32_t len) {
+    while (len > 0) {
+        int bytes = send(socket, data, len, 0);
+        if (bytes <= 0) {
+            if ((bytes < 0) && (errno == EINTR)) {
+                continue;
+            }
+            return false;
+        }
+        data += bytes;
+        len -= bytes;
+    }
+    return true;
+}
 
-    // if there are any headers send them first
-    if (response->headerCount > 0) {
-        for(uint8_t i = 0; i < response->headerCount; i++) {
-            shttpHeader *header = &(response->headers[i]);
-            LOG(TRACE, "shttp: sending header '%s: %s' (%d and %d bytes)", header->name, header->value, strlen(header->name), strlen(header->value));
+// send everything and count it
+static bool shttp_send_counted(int socket, const char *data, uint32_t len, uint32_t *sent) {
+    if (!shttp_send_all(socket, data, len)) {
+        return false;
+    }
+    *sent += len;
+    return true;
+}
+
+// the ESP8266 maps flash (ICACHE_RODATA_ATTR) at these addresses, it can
+// only be read in whole words. There is no flash in the host build
+#define SHTTP_FLASH_START 0x40200000
+#define SHTTP_FLASH_END   0x40300000
+
+// copy `len` bytes of constant data that may be in flash. Flash data is
+// word aligned (STORE_ATTR), the full words are copied one by one and the
+// last partial word is fetched once, of it only the bytes of the data are
+// kept. Flash is mapped in whole words, so that fetch stays in the mapping
+static void shttp_copy_static(uint32_t *out, const char *data, uint32_t len) {
+    if (((uintptr_t)data < SHTTP_FLASH_START) || ((uintptr_t)data >= SHTTP_FLASH_END)) {
+        // not flash, a byte copy is fine
+        memcpy(out, data, len);
+        return;
+    }
 
-            send(socket, header->name, strlen(header->name), 0);
-            send(socket, ": ", 2, 0);
-            send(socket, header->value, strlen(header->value), 0);
-            send(socket, "\r\n", 2, 0);
+    const uint32_t *words = (const uint32_t *)data;
+    uint32_t numWords = len / 4;
+    for (uint32_t i = 0; i < numWords; i++) {
+        out[i] = words[i];
+    }
+
+    uint32_t rest = len & 3;
+    if (rest > 0) {
+        uint32_t last = words[numWords];
+        memcpy(out + numWords, &last, rest);
+    }
+}
 
-            free(header->name);
-            free(header->value);
+// send constant data through the aligned buffer `chunk` (of
+// SHTTP_STATIC_CHUNK bytes) one send per chunk, so lwIP never touches flash
+static bool shttp_send_static(int socket, const char *data, uint32_t len, uint32_t *chunk, uint32_t *sent) {
+    while (len > 0) {
+        uint32_t part = MIN(len, SHTTP_STATIC_CHUNK);
+        shttp_copy_static(chunk, data, part);
+
+        if (!shttp_send_counted(socket, (char *)chunk, part, sent)) {
+            return false;
         }
-        free(response->headers);
+        data += part;
+        len -= part;
+    }
+    return true;
+}
+
+// send the body of a response, static bodies are not freed
+static bool shttp_send_body(shttpResponse *response, int socket, uint32_t len, uint32_t *chunk, uint32_t *sent) {
+    if (response->staticBody) {
+        return shttp_send_static(socket, response->body, len, chunk, sent);
+    }
+    return shttp_send_counted(socket, response->body, len, sent);
+}
+
+static void shttp_free_body(shttpResponse *response) {
+    if (!response->staticBody) {
+        free(response->body);
+    }
+}
+
+static char *shttp_append(char *out, const char *data, uint16_t len) {
+    memcpy(out, data, len);
+    return out + len;
+}
+
+// the last line of a prebuilt header block and its replacement
+#define SHTTP_KEEP_ALIVE_LINE "Connection: keep-alive\r\n\r\n"
+#define SHTTP_CLOSE_LINE "Connection: close\r\n\r\n"
+
+// send a response with a prebuilt header block, nothing has to be formatted.
+// The block is constant data like a static body, it may be in flash
+static shttpConnectionState shttp_write_prebuilt_response(shttpResponse *response, int socket, uint8_t keepAlive, uint32_t *chunk, uint32_t *bytesSent) {
+    uint32_t sent = 0;
+    bool ok;
+
+    if (keepAlive > 0) {
+        ok = shttp_send_static(socket, response->headerBlock, response->headerBlockLen, chunk, &sent);
+    } else {
+        // rare, once per connection at most. The block is cut at its end,
+        // the start stays aligned
+        ok = shttp_send_static(socket, response->headerBlock, response->headerBlockLen - strlen(SHTTP_KEEP_ALIVE_LINE), chunk, &sent) &&
+            shttp_send_counted(socket, SHTTP_CLOSE_LINE, strlen(SHTTP_CLOSE_LINE), &sent);
+    }
+    if ((ok) && (response->body != NULL)) {
+        ok = shttp_send_body(response, socket, response->bodyLen, chunk, &sent);
     }
-    // Send a connection close header as we close the connection anyway
-    send(socket, "Connection: close\r\n", 19, 0);
+
+    shttp_free_body(response);
+    free(response);
+
+    if (bytesSent != NULL) {
+        *bytesSent = sent;
+    }
+    return (ok && (keepAlive > 0)) ? shttpConnectionKeepAlive : shttpConnectionClose;
+}
+
+shttpConnectionState shttp_write_response(shttpResponse *response, int socket, uint8_t keepAlive, bool chunked, uint32_t *chunk, uint32_t *bytesSent) {
+    if (response->headerBlock != NULL) {
+        return shttp_write_prebuilt_response(response, socket, keepAlive, chunk, bytesSent);
+    }
+
+    const char *statusLine = shttp_status_line(response->responseCode);
+    uint32_t sent = 0;
+
+    LOG(TRACE, "shttp: sending response '%s'", statusLine);
 
     // if we know the body length add a content-length header
     uint32_t contentLength = 0;
+    bool lengthKnown = true;
     if (response->body) {
         LOG(TRACE, "shttp: body len value %d", response->bodyLen);
         contentLength = (response->bodyLen > 0) ? response->bodyLen : strlen(response->body);
     }
     if (response->bodyCallback) {
         contentLength = (response->bodyLen > 0) ? response->bodyLen : 0;
+        lengthKnown = (response->bodyLen > 0);
+    }
+    if (response->jsonCallback) {
+        contentLength = shttp_json_measure(response);
+    }
+    if (response->takeoverCallback) {
+        // the body is written by the new owner of the connection until it
+        // closes it, no other response follows
+        lengthKnown = false;
+        keepAlive = 0;
+    }
+    if (response->responseCode == shttpStatusServiceUnavailable) {
+        // the server is out of room, free the connection too
+        keepAlive = 0;
     }
-    if (contentLength > 0) {
-        char *tmp = malloc(18 + 8); // max 99 MB
-        sprintf(tmp, "Content-Length: %d\r\n", contentLength);
-        send(socket, tmp, strlen(tmp), 0);
-        free(tmp);
+    char contentLengthLine[18 + 11] = "";
+    bool upgrade = (response->responseCode == shttpStatusSwitchingProtocols);
+    if ((response->responseCode == shttpStatusNoContent) || (response->responseCode == shttpStatusNotModified) || (upgrade)) {
+        // these never have a body
+        lengthKnown = true;
+        chunked = false;
+    } else if (lengthKnown) {
+        sprintf(contentLengthLine, "Content-Length: %u\r\n", contentLength);
+        chunked = false;
+    } else if (chunked) {
+        // the body is framed in chunks, the connection may stay open
+        strcpy(contentLengthLine, "Transfer-Encoding: chunked\r\n");
+    } else {
+        // without a length the end of the body is signalled by closing the connection
+        keepAlive = 0;
+    }
+    char connectionLines[20 + 10 + 6 + 3 + 3 + 24];
+    if (upgrade) {
+        // the route sets the Connection header for the new protocol
+        connectionLines[0] = '\0';
+    } else if (keepAlive > 0) {
+        sprintf(connectionLines, "Keep-Alive: timeout=%d, max=%d\r\nConnection: keep-alive\r\n", SHTTP_IDLE_TIMEOUT / 1000, keepAlive);
+    } else {
+        strcpy(connectionLines, "Connection: close\r\n");
     }
 
     LOG(TRACE, "shttp: content length: %d", contentLength);
 
-    // finish header block
-    send(socket, "\r\n", 2, 0);
+    // size of the header block
+    uint16_t statusLen = strlen(statusLine);
+    uint16_t contentLengthLen = strlen(contentLengthLine);
+    uint16_t connectionLen = strlen(connectionLines);
+    uint16_t headerLen = statusLen + contentLengthLen + connectionLen + 2;
+    for(uint8_t i = 0; i < response->headerCount; i++) {
+        headerLen += strlen(response->headers[i].name) + 2 + strlen(response->headers[i].value) + 2;
+    }
+
+    // the header block goes out in one write, small bodies go along
+    char stackBuffer[SHTTP_RESPONSE_BUFFER];
+    char *buffer = stackBuffer;
+    bool coalesceBody = (((response->body != NULL) && (!response->staticBody)) || (response->jsonCallback)) && (headerLen + contentLength <= SHTTP_RESPONSE_BUFFER);
+    if (headerLen > SHTTP_RESPONSE_BUFFER) {
+        buffer = malloc(headerLen);
+    }
+
+    bool ok = (buffer != NULL);
+    if (ok) {
+        char *out = shttp_append(buffer, statusLine, statusLen);
+        for(uint8_t i = 0; i < response->headerCount; i++) {
+            shttpHeader *header = &(response->headers[i]);
+            LOG(TRACE, "shttp: adding header '%s: %s'", header->name, header->value);
+
+            out = shttp_append(out, header->name, strlen(header->name));
+            out = shttp_append(out, ": ", 2);
+            out = shttp_append(out, header->value, strlen(header->value));
+            out = shttp_append(out, "\r\n", 2);
+        }
+        out = shttp_append(out, contentLengthLine, contentLengthLen);
+        out = shttp_append(out, connectionLines, connectionLen);
+        out = shttp_append(out, "\r\n", 2);
+        if ((coalesceBody) && (response->jsonCallback)) {
+            // nothing is sent if the body does not match the headers
+            ok = shttp_json_write(response, contentLength, out, contentLength, -1, NULL);
+            out += contentLength;
+        } else if (coalesceBody) {
+            out = shttp_append(out, response->body, contentLength);
+        }
+
+        if (ok) {
+            ok = shttp_send_counted(socket, buffer, out - buffer, &sent);
+        }
+        if (buffer != stackBuffer) {
+            free(buffer);
+        }
+    } else {
+        LOG(ERROR, "shttp: Out of memory while building response headers");
+    }
+
+    // headers are not needed anymore
+    for(uint8_t i = 0; i < response->headerCount; i++) {
+        free(response->headers[i].name);
+        free(response->headers[i].value);
+    }
+    if (response->headerCount > 0) {
+        free(response->headers);
+    }
 
     // send body
     if (response->body) {
         // body data available, direct send
-        LOG(TRACE, "shttp: sending body data (%s)", response->body);
-        send(socket, response->body, contentLength, 0);
-        free(response->body);
+        if ((ok) && (!coalesceBody)) {
+            LOG(TRACE, "shttp: sending body data (%d bytes)", contentLength);
+            ok = shttp_send_body(response, socket, contentLength, chunk, &sent);
+        }
+        shttp_free_body(response);
+    }
+    if ((response->jsonCallback) && (ok) && (!coalesceBody)) {
+        // written straight into the send buffer, the headers are out
+        LOG(TRACE, "shttp: sending JSON body (%d bytes)", contentLength);
+        ok = shttp_json_write(response, contentLength, stackBuffer, SHTTP_RESPONSE_BUFFER, socket, &sent);
     }
     if (response->bodyCallback) {
         // callback option, repeatedly call callback and stream out data
@@ -134,39 +339,61 @@ void shttp_write_response(shttpResponse *response, int socket) {
 
         uint32_t position = 0;
         uint32_t chunkLen = 0;
-        while (1) {
+        while (ok) {
             char *chunk = response->bodyCallback(position, &chunkLen, response->callbackUserData);
             if (!chunk) {
                 // if chunk is NULL, callback is finished, clean up
                 LOG(TRACE, "shttp: body chunk stream finished");
-                response->cleanupCallback(response->callbackUserData);
                 break;
             }
             LOG(TRACE, "shttp: body chunk %d bytes @ %d", chunkLen, position);
 
-            // send the chunk and free the memory
-            bool fault = false;
-            while (1) {
-                int bytes = send(socket, chunk, chunkLen, 0);
-                if (bytes == 0) {
-                    if (errno == EINTR) {
-                        continue;
-                    }
-                    fault = true;
-                    break;
-                }
-                break;
+            // the chunk size line goes in front of the data, together
+            // with the line break that ends the previous chunk. An
+            // empty chunk would end the body, skip those
+            if ((chunked) && (chunkLen > 0)) {
+                char sizeLine[2 + 8 + 2 + 1];
+                sprintf(sizeLine, "%s%x\r\n", (position > 0) ? "\r\n" : "", chunkLen);
+                ok = shttp_send_counted(socket, sizeLine, strlen(sizeLine), &sent);
+            }
+
+            // send the chunk and free the memory, on a network
+            // fault cancel sending data
+            if (ok) {
+                ok = shttp_send_counted(socket, chunk, chunkLen, &sent);
             }
             free(chunk);
 
             // increment position
             position += chunkLen;
-
-            if (fault) {
-                return; // Network disconnected, cancel sending data
-            }
         }
+        if ((ok) && (chunked)) {
+            // last chunk and end of the (empty) trailer
+            const char *end = (position > 0) ? "\r\n0\r\n\r\n" : "0\r\n\r\n";
+            ok = shttp_send_counted(socket, end, strlen(end), &sent);
+        }
+    }
+    // hand over the connection
+    bool detached = false;
+    if ((ok) && (response->takeoverCallback)) {
+        detached = response->takeoverCallback(socket, chunked, response->callbackUserData);
+    }
+    if (response->cleanupCallback) {
+        response->cleanupCallback(response->callbackUserData);
+    }
+
+    free(response);
+
+    if (bytesSent != NULL) {
+        *bytesSent = sent;
+    }
+    if (detached) {
+        return shttpConnectionDetached;
     }
+    if (upgrade) {
+        return (ok) ? shttpConnectionUpgraded : shttpConnectionClose;
+    }
+    return (ok && (keepAlive > 0)) ? shttpConnectionKeepAlive : shttpConnectionClose;
 }
 
 //
@@ -218,17 +445,18 @@ void shttp_response_add_headers(shttpResponse *response, ...) {
         return;
     }
 
-    // allocate memory
-    
-    response->headers = malloc((headerCount + 1) * sizeof(shttpHeader));
-    if (!response->headers) {
+    // allocate memory, headers added before are kept
+    uint8_t oldCount = response->headerCount;
+    shttpHeader *headers = realloc(response->headers, (oldCount + headerCount + 1) * sizeof(shttpHeader));
+    if (!headers) {
         return; // Out of memory
     }
+    response->headers = headers;
     for(uint8_t i = 0; i < headerCount; i++) {
-        response->headers[i].name = cName[i];
-        response->headers[i].value = cValue[i];
+        response->headers[oldCount + i].name = cName[i];
+        response->headers[oldCount + i].value = cValue[i];
     }
-    response->headerCount = headerCount;
+    response->headerCount = oldCount + headerCount;
 }
 
 shttpResponse *shttp_empty_response(shttpStatusCode status) {
@@ -243,12 +471,22 @@ shttpResponse *shttp_empty_response(shttpStatusCode status) {
 shttpResponse *shttp_json_response(shttpStatusCode status, cJSON *json) {
     shttpResponse *response = shttp_empty_response(status);
     shttp_response_add_headers(response, "Content-Type", "application/json", NULL);
-    response->body = cJSON_Print(json);
+    response->body = cJSON_PrintUnformatted(json);
     cJSON_Delete(json);
     return response;
 }
 #endif /* SHTTP_CJSON */
 
+shttpResponse *shttp_json_writer_response(shttpStatusCode status, shttpJSONCallback *callback, void *userData, shttpCleanupCallback *cleanup) {
+    shttpResponse *response = shttp_empty_response(status);
+    shttp_response_add_headers(response, "Content-Type", "application/json", NULL);
+    response->jsonCallback = callback;
+    response->callbackUserData = userData;
+    response->cleanupCallback = cleanup;
+
+    return response;
+}
+
 shttpResponse *shttp_html_response(shttpStatusCode status, char *html) {
     shttpResponse *response = shttp_empty_response(status);
     shttp_response_add_headers(response, "Content-Type", "text/html", NULL);
@@ -299,9 +537,31 @@ shttpResponse *shttp_download_response(shttpStatusCode status, char *buffer, uin
 
 shttpResponse *shttp_download_callback_response(shttpStatusCode status, uint32_t len, char *filename, shttpBodyCallback *callback, void *userData, shttpCleanupCallback *cleanup) {
     shttpResponse *response = shttp_download_response(status, NULL, 0, filename);
+    response->bodyLen = len;
     response->bodyCallback = callback;
     response->callbackUserData = userData;
     response->cleanupCallback = cleanup;
 
     return response;
 }
+
+shttpResponse *shttp_static_response(shttpStatusCode status, char *contentType, const char *body, uint32_t len) {
+    shttpResponse *response = shttp_empty_response(status);
+    shttp_response_add_headers(response, "Content-Type", contentType, NULL);
+    response->body = (char *)body;
+    response->bodyLen = len;
+    response->staticBody = true;
+
+    return response;
+}
+
+shttpResponse *shttp_prebuilt_response(shttpStatusCode status, const char *headerBlock, uint16_t headerBlockLen, const char *body, uint32_t bodyLen) {
+    shttpResponse *response = shttp_empty_response(status);
+    response->headerBlock = headerBlock;
+    response->headerBlockLen = headerBlockLen;
+    response->body = (char *)body;
+    response->bodyLen = bodyLen;
+    response->staticBody = true;
+
+    return response;
+}
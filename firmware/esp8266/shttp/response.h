@@ -3,6 +3,25 @@
 
 #include "simplehttp/http.h"
 
-void shttp_write_response(shttpResponse *response, int socket);
+// what happens to the connection after a response
+typedef enum _shttpConnectionState {
+    shttpConnectionClose = 0,   // close it
+    shttpConnectionKeepAlive,   // wait for the next request
+    shttpConnectionDetached,    // taken over by the response, do not touch it
+    shttpConnectionUpgraded     // switched protocols, see websocket.h
+} shttpConnectionState;
+
+// send everything, returns false if the connection failed
+bool shttp_send_all(int socket, const char *data, uint32_t len);
+
+// send the response to the client and free it
+// - keepAlive: number of requests the client may still send on this
+//   connection, zero closes the connection after the response
+// - chunked: client understands chunked transfer encoding (HTTP/1.1),
+//   used for callback bodies without a length
+// - chunk: word aligned buffer of SHTTP_STATIC_CHUNK bytes static data is
+//   sent through
+// - bytesSent: set to the number of bytes written, may be NULL
+shttpConnectionState shttp_write_response(shttpResponse *response, int socket, uint8_t keepAlive, bool chunked, uint32_t *chunk, uint32_t *bytesSent);
 
 #endif /* shttp_response_h_included */
\ No newline at end of file
@@ -5,141 +5,330 @@
 #include <stdlib.h>
 
 #include "debug.h"
+#include "router.h"
 #include "response.h"
 
 extern shttpConfig *shttpServerConfig;
 
-static shttpRoute *shttp_find_route(char *path, shttpMethod method, shttpRequest *request) {
-    uint8_t pathLen = strlen(path);
+// Routes are compiled into a prefix tree when the server starts. Every
+// node matches a literal part of the path, a parameter (`?`) or the
+// rest of the path (`*`). Nodes a route path ends on know the methods
+// of those routes, so a lookup walks the request path once and can
+// tell a wrong method (405) from a missing path (404).
+typedef struct _shttpRouteNode {
+    // literal part of the path, points into a route path
+    const char *prefix;
+    uint16_t prefixLen;
 
-    LOG(TRACE, "shttp: finding route for '%s' (%d chars)", path, pathLen);
+    // routes ending on this node and their methods
+    shttpMethod methods;
+    shttpRoute **routes;
+    uint8_t numRoutes;
 
-    if (shttpServerConfig->appendSlashes) {
-        if (path[pathLen - 1] == '/') {
-            path[pathLen - 1] = '\0';
-            pathLen--;
-        }
-    }
+    // literal children (distinct first characters), next sibling
+    struct _shttpRouteNode *children;
+    struct _shttpRouteNode *next;
 
-    uint8_t currentRoute = 0;
-    shttpRoute *route = shttpServerConfig->routes[currentRoute];
-    while(route != NULL) {
-        uint8_t routeLen = strlen(route->path);
-        LOG(TRACE, "shttp: trying route '%s' (%d chars)", route->path, routeLen);
+    // parameter and wildcard children
+    struct _shttpRouteNode *parameter;
+    struct _shttpRouteNode *wildcard;
+} shttpRouteNode;
 
-        bool found = true;
-        uint8_t pathIndex = 0, routeIndex = 0;
-        for (; pathIndex < pathLen; pathIndex++) {
-            if (routeIndex >= routeLen) {
-                LOG(TRACE, "shttp: route length reached at %d, pathIndex: %d", routeIndex, pathIndex);
-                found = false;
-                break;
-            }
+// parameter positions while matching, written to the request on success
+typedef struct _shttpRouteMatch {
+    shttpMethod method;
+    shttpMethod allowed; // methods of paths that matched without the method
+    uint8_t numParameters;
+    char *parameters[SHTTP_MAX_PATH_PARAMETERS];
+    uint16_t parameterLen[SHTTP_MAX_PATH_PARAMETERS];
+} shttpRouteMatch;
 
-            if (route->path[routeIndex] == '?') {
-                LOG(TRACE, "shttp: parameter in route at %d (%d chars left)", routeIndex, pathLen - pathIndex);
+static shttpRouteNode *routeTree;
 
-                // found parameter, skip path to next slash or end
-                for(uint8_t i = 0; i < pathLen - pathIndex; i++) {
-                    if ((path[pathIndex + i] == '/') || (path[pathIndex + i] == ' ') || (i == pathLen - pathIndex - 1)) {
-                        LOG(TRACE, "shttp: parameter length in path: %d", i + 1);
-                        pathIndex += i;
-                        break;
-                    }
-                }
+static shttpRouteNode *shttp_route_node(const char *prefix, uint16_t prefixLen) {
+    shttpRouteNode *node = calloc(1, sizeof(shttpRouteNode));
+    if (node == NULL) {
+        LOG(ERROR, "shttp: Out of memory while compiling routes");
+        return NULL;
+    }
+    node->prefix = prefix;
+    node->prefixLen = prefixLen;
+    return node;
+}
 
-                routeIndex++;
-                continue;
-            } else if (route->path[routeIndex] == '*') {
-                LOG(TRACE, "shttp: wildcard in route at %d", routeIndex);
-                found = true;
-                routeIndex++;
-                break;
-            } else if (route->path[routeIndex] != path[pathIndex]) {
-                LOG(TRACE, "shttp: mismatch at %d", routeIndex);
-                found = false;
-                break;
-            }
-            routeIndex++;
+static void shttp_destroy_route_node(shttpRouteNode *node) {
+    while (node != NULL) {
+        shttpRouteNode *next = node->next;
+        shttp_destroy_route_node(node->children);
+        shttp_destroy_route_node(node->parameter);
+        shttp_destroy_route_node(node->wildcard);
+        free(node->routes);
+        free(node);
+        node = next;
+    }
+}
+
+// descend into the literal child matching `path`, splits a child that
+// only shares a part of its prefix, returns the number of matched chars
+static shttpRouteNode *shttp_insert_literal(shttpRouteNode *node, const char *path, uint16_t len, uint16_t *matched) {
+    shttpRouteNode *child = node->children;
+    while ((child != NULL) && (child->prefix[0] != path[0])) {
+        child = child->next;
+    }
+
+    if (child == NULL) {
+        child = shttp_route_node(path, len);
+        if (child == NULL) {
+            return NULL;
         }
+        child->next = node->children;
+        node->children = child;
+        *matched = len;
+        return child;
+    }
+
+    uint16_t common = 0;
+    while ((common < len) && (common < child->prefixLen) && (child->prefix[common] == path[common])) {
+        common++;
+    }
 
-        if (routeIndex < routeLen) {
-            found = false;   
+    if (common < child->prefixLen) {
+        // split: the child keeps the common part, the rest moves down
+        shttpRouteNode *rest = shttp_route_node(child->prefix + common, child->prefixLen - common);
+        if (rest == NULL) {
+            return NULL;
         }
+        rest->methods = child->methods;
+        rest->routes = child->routes;
+        rest->numRoutes = child->numRoutes;
+        rest->children = child->children;
+        rest->parameter = child->parameter;
+        rest->wildcard = child->wildcard;
+
+        child->prefixLen = common;
+        child->methods = 0;
+        child->routes = NULL;
+        child->numRoutes = 0;
+        child->children = rest;
+        child->parameter = NULL;
+        child->wildcard = NULL;
+    }
+
+    *matched = common;
+    return child;
+}
+
+static bool shttp_insert_route(shttpRouteNode *root, shttpRoute *route) {
+    shttpRouteNode *node = root;
+    const char *path = route->path;
 
-        if (found) {
-            // check if the method matches
-            if ((route->allowedMethods & method) != 0) {
-                break;
+    while ((*path != '\0') && (node != NULL)) {
+        if (*path == '?') {
+            if (node->parameter == NULL) {
+                node->parameter = shttp_route_node(path, 0);
             }
+            node = node->parameter;
+            path++;
+        } else if (*path == '*') {
+            // wildcards are only allowed at the end
+            if (node->wildcard == NULL) {
+                node->wildcard = shttp_route_node(path, 0);
+            }
+            node = node->wildcard;
+            break;
+        } else {
+            uint16_t matched;
+            node = shttp_insert_literal(node, path, strcspn(path, "?*"), &matched);
+            path += matched;
         }
+    }
+    if (node == NULL) {
+        return false;
+    }
 
-        currentRoute++;
-        route = shttpServerConfig->routes[currentRoute];
+    shttpRoute **routes = realloc(node->routes, (node->numRoutes + 1) * sizeof(shttpRoute *));
+    if (routes == NULL) {
+        LOG(ERROR, "shttp: Out of memory while compiling routes");
+        return false;
     }
+    node->routes = routes;
+    node->routes[node->numRoutes++] = route;
+    node->methods |= route->allowedMethods;
 
-    return route;
+    return true;
 }
 
-static void shttp_parse_url_parameters(char *path, shttpRoute *route, shttpRequest *request) {    
-    uint8_t pathLen = strlen(path);
-    uint8_t routeLen = strlen(route->path);
-    for (uint8_t pathIndex = 0, routeIndex = 0; pathIndex < pathLen; pathIndex++) {
-        if (routeIndex >= routeLen) {
-            break;
+// match the rest of `path` below `node`, literals are tried before
+// parameters and parameters before wildcards
+static shttpRouteNode *shttp_match_node(shttpRouteNode *node, char *path, shttpRouteMatch *match) {
+    if (*path == '\0') {
+        if (node->numRoutes > 0) {
+            if (node->methods & match->method) {
+                return node;
+            }
+            match->allowed |= node->methods;
         }
+        return NULL;
+    }
 
-        if (route->path[routeIndex] == '?') {
-            LOG(TRACE, "shttp: parser -> URL path parameter in route at %d", routeIndex);
-
-            // found parameter, find next slash
-            for(uint8_t i = 0; i < pathLen - pathIndex; i++) {
-                if ((path[pathIndex + i] == '/') || (path[pathIndex + i] == ' ') || (i == pathLen - pathIndex - 1)) {
-                    // copy parameter value
-                    char *param = malloc(i + 2);
-                    memcpy(param, path + pathIndex, i + 1);
-                    param[i + 1] = '\0';
-
-                    LOG(TRACE, "shttp: URL path parameter '%s'", param);
-                    // realloc parameter array and append param
-                    request->pathParameters = realloc(request->pathParameters, (request->numPathParameters + 1) * sizeof(char *));
-                    request->pathParameters[request->numPathParameters] = param;
-                    request->numPathParameters++;
-
-                    // skip over the parameter and continue parsing
-                    pathIndex += i;
-                    break;
+    for (shttpRouteNode *child = node->children; child != NULL; child = child->next) {
+        if (child->prefix[0] == *path) {
+            if (strncmp(child->prefix, path, child->prefixLen) == 0) {
+                shttpRouteNode *result = shttp_match_node(child, path + child->prefixLen, match);
+                if (result != NULL) {
+                    return result;
                 }
             }
-
-            routeIndex++;
-            continue;            
-        } else if (route->path[routeIndex] == '*') {
             break;
         }
+    }
+
+    // parameters run up to the next slash and may not be empty
+    if ((node->parameter != NULL) && (*path != '/')) {
+        char *end = path;
+        while ((*end != '\0') && (*end != '/')) {
+            end++;
+        }
+
+        uint8_t index = match->numParameters;
+        if (index < SHTTP_MAX_PATH_PARAMETERS) {
+            match->parameters[index] = path;
+            match->parameterLen[index] = end - path;
+        }
+        match->numParameters++;
+
+        shttpRouteNode *result = shttp_match_node(node->parameter, end, match);
+        if (result != NULL) {
+            return result;
+        }
+        match->numParameters = index;
+    }
 
-        routeIndex++;
+    if ((node->wildcard != NULL) && (node->wildcard->numRoutes > 0)) {
+        if (node->wildcard->methods & match->method) {
+            return node->wildcard;
+        }
+        match->allowed |= node->wildcard->methods;
     }
 
+    return NULL;
 }
 
-void shttp_exec_route(char *path, shttpMethod method, shttpRequest *request, int socket) {
+static shttpResponse *shttp_not_allowed_response(shttpMethod methods) {
+    static const char *names[] = { "GET", "POST", "PUT", "PATCH", "DELETE", "OPTIONS", "HEAD" };
+    char allow[45];
+
+    // list the methods the path supports
+    allow[0] = '\0';
+    for (uint8_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (methods & (1 << i)) {
+            if (allow[0] != '\0') {
+                strcat(allow, ", ");
+            }
+            strcat(allow, names[i]);
+        }
+    }
+
+    shttpResponse *response = shttp_empty_response(shttpStatusNotAllowed);
+    shttp_response_add_headers(response, "Allow", allow, NULL);
+    return response;
+}
+
+bool shttp_compile_routes(shttpRoute **routes) {
+    routeTree = shttp_route_node("", 0);
+    if (routeTree == NULL) {
+        return false;
+    }
+
+    for (uint8_t i = 0; routes[i] != NULL; i++) {
+        if (!shttp_insert_route(routeTree, routes[i])) {
+            shttp_destroy_routes();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void shttp_destroy_routes(void) {
+    shttp_destroy_route_node(routeTree);
+    routeTree = NULL;
+}
+
+shttpRoute *shttp_find_route(char *path, shttpMethod method, shttpRequest *request, shttpMethod *allowed) {
+    uint16_t pathLen = strlen(path);
+
+    LOG(TRACE, "shttp: finding route for '%s' (%d chars)", path, pathLen);
+
+    if ((shttpServerConfig->appendSlashes) && (pathLen > 0) && (path[pathLen - 1] == '/')) {
+        path[pathLen - 1] = '\0';
+    }
+
     // find a route
-    shttpRoute *route = shttp_find_route(path, method, request);
-    LOG(TRACE, "shttp: Route %x", route);
+    shttpRouteMatch match;
+    match.method = method;
+    match.allowed = 0;
+    match.numParameters = 0;
+    shttpRouteNode *node = shttp_match_node(routeTree, path, &match);
+
+    request->numPathParameters = 0;
+    if (node == NULL) {
+        *allowed = match.allowed;
+        return NULL;
+    }
 
-    // no route found return 404
-    if (!route) {
-        LOG(TRACE, "shttp: no route, returning 404");
-        shttp_write_response(shttp_empty_response(shttpStatusNotFound), socket);
+    // with multiple routes on one path the first one allowing the method wins
+    shttpRoute *route = NULL;
+    for (uint8_t i = 0; i < node->numRoutes; i++) {
+        if (node->routes[i]->allowedMethods & method) {
+            route = node->routes[i];
+            break;
+        }
     }
+    LOG(TRACE, "shttp: Route %p", (void *)route);
 
-    // parse url parameters
-    shttp_parse_url_parameters(path, route, request);
+    // the path is not needed anymore, zero terminate the parameters in place
+    for (uint8_t i = 0; (i < match.numParameters) && (i < SHTTP_MAX_PATH_PARAMETERS); i++) {
+        match.parameters[i][match.parameterLen[i]] = '\0';
+        request->pathParameters[request->numPathParameters++] = match.parameters[i];
+    }
     LOG(TRACE, "shttp: %d URL path parameters", request->numPathParameters);
 
-    // call callback and return response
-    shttp_write_response(route->callback(request, route->userData), socket);
+    *allowed = route->allowedMethods;
+    return route;
+}
+
+shttpConnectionState shttp_send_response(shttpRoute *route, shttpRequestTiming *timing, shttpResponse *response, int socket, uint8_t keepAlive, bool chunked, uint32_t *chunk) {
+    // the response is gone after sending
+    shttpStatusCode status = response->responseCode;
+    uint32_t bytesOut = 0;
+
+    shttpConnectionState result = shttp_write_response(response, socket, keepAlive, chunked, chunk, &bytesOut);
+    shttp_metrics_request(route, timing, status, bytesOut);
+    return result;
+}
+
+shttpConnectionState shttp_exec_route(shttpRoute *route, shttpMethod allowed, shttpRequest *request, shttpRequestTiming *timing, int socket, uint8_t keepAlive, bool chunked, uint32_t *chunk) {
+    shttpResponse *response;
+
+    timing->handler = shttp_metrics_now();
+    if (route == NULL) {
+        if (allowed != 0) {
+            LOG(TRACE, "shttp: method not allowed, returning 405");
+            response = shttp_not_allowed_response(allowed);
+        } else {
+            // no route found return 404
+            LOG(TRACE, "shttp: no route, returning 404");
+            response = shttp_empty_response(shttpStatusNotFound);
+        }
+    } else {
+        // call callback, the heap is at its lowest while the response is held
+        response = route->callback(request, route->userData);
+        shttp_metrics_heap();
+    }
+    timing->handled = shttp_metrics_now();
+
+    return shttp_send_response(route, timing, response, socket, keepAlive, chunked, chunk);
 }
 
 //
@@ -152,6 +341,18 @@ shttpRoute *shttp_route(shttpMethod method, char *path, shttpRouteCallback *call
     route->path = path;
     route->callback = callback;
     route->userData = userData;
+    route->bodyCallback = NULL;
+    route->websocketCallback = NULL;
+    route->metrics = NULL;
+
+    return route;
+}
+
+shttpRoute *shttp_streaming_route(shttpMethod method, char *path, shttpRequestBodyCallback *bodyCallback, shttpRouteCallback *callback, void *userData) {
+    shttpRoute *route = shttp_route(method, path, callback, userData);
+    if (route != NULL) {
+        route->bodyCallback = bodyCallback;
+    }
 
     return route;
-}
\ No newline at end of file
+}
@@ -2,7 +2,23 @@
 #define shttp_router_h_included
 
 #include "simplehttp/http.h"
+#include "response.h"
+#include "metrics.h"
 
-void shttp_exec_route(char *path, shttpMethod method, shttpRequest *request, int socket);
+// compile the NULL terminated route list for lookups, call before serving
+bool shttp_compile_routes(shttpRoute **routes);
+void shttp_destroy_routes(void);
+
+// find the route for `path` and set the path parameters of `request`,
+// returns NULL if there is none, `allowed` then has the methods of the path
+shttpRoute *shttp_find_route(char *path, shttpMethod method, shttpRequest *request, shttpMethod *allowed);
+
+// run a route found by shttp_find_route or answer with 404/405 if NULL,
+// `chunk` is the static data buffer (see shttp_write_response)
+shttpConnectionState shttp_exec_route(shttpRoute *route, shttpMethod allowed, shttpRequest *request, shttpRequestTiming *timing, int socket, uint8_t keepAlive, bool chunked, uint32_t *chunk);
+
+// send the response to a request for `route` (NULL if none matched) and
+// record the request in the metrics
+shttpConnectionState shttp_send_response(shttpRoute *route, shttpRequestTiming *timing, shttpResponse *response, int socket, uint8_t keepAlive, bool chunked, uint32_t *chunk);
 
 #endif /* shttp_router_h_included */
\ No newline at end of file
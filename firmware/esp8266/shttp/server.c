@@ -21,10 +21,70 @@
 
 #include "parser.h"
 #include "router.h"
+#include "metrics.h"
+#include "events.h"
+
+#ifndef MAX
+#define MAX(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a > _b ? _a : _b; })
+#endif
+
+// lwIP defines this in sockets.h, POSIX systems in netinet/tcp.h
+#ifndef TCP_NODELAY
+#define TCP_NODELAY 0x01
+#endif
 
 static int listeningSocket;
+
+#if SHTTP_EVENT_LOOP
+// per connection state, parsers are allocated once when the server starts
+typedef struct _shttpConnection {
+    int socket;
+    portTickType lastActivity;
+    shttpParserState *parser;
+} shttpConnection;
+
+static shttpConnection connections[SHTTP_MAX_CONNECTIONS];
+
+// all responses are sent from this task, the parsers share one buffer
+static uint32_t staticChunk[SHTTP_STATIC_CHUNK / 4];
+#else
+// per worker state, parsers are allocated once when the server starts
+typedef struct _shttpWorker {
+    xTaskHandle task;
+    shttpParserState *parser;
+} shttpWorker;
+
+// a connection waiting for a worker
+typedef struct _shttpQueuedConnection {
+    int socket;
+    uint32_t accepted; // see shttp_metrics_now
+    bool resumed;      // a parked connection, its state is in `parked`
+    shttpParkedState parked;
+} shttpQueuedConnection;
+
+// an idle persistent connection without a worker, the accepting task
+// watches it until the next request arrives
+typedef struct _shttpParkedConnection {
+    int socket;
+    portTickType since;
+    bool watched; // in the set of the running select
+    shttpParkedState state;
+} shttpParkedConnection;
+
 static xQueueHandle connectionQueue;
-static xTaskHandle dataTask;
+static shttpWorker workers[SHTTP_WORKERS];
+
+// static data buffer of every worker, kept off the task stacks
+static uint32_t staticChunks[SHTTP_WORKERS][SHTTP_STATIC_CHUNK / 4];
+
+// holds one token while nobody uses the parked connections
+static xQueueHandle parkedLock;
+static uint8_t numParked;
+static shttpParkedConnection parked[SHTTP_MAX_PARKED_CONNECTIONS];
+#endif /* SHTTP_EVENT_LOOP */
 
 volatile shttpConfig *shttpServerConfig;
 
@@ -57,7 +117,7 @@ static bool bind_and_listen(const char *port) {
 
 		// SO_REUSEADDR option is disabled by default in lwip
 #if SO_REUSE
-        const char n = 1;
+        const int n = 1;
         if (setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEADDR, &n, sizeof(n)) != 0) {
             close(listeningSocket);
             LOG(ERROR, "shttp: Setting SO_REUSEADDR option failed!")
@@ -92,109 +152,565 @@ static bool bind_and_listen(const char *port) {
     return false;
 }
 
+static void shttp_set_nodelay(int socket) {
+    // responses are written in pieces, do not let Nagle hold back the
+    // tail of a response until the client ACKs (stalls keep-alive)
+    const int noDelay = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+}
+
+#if !SHTTP_EVENT_LOOP
+static void shttp_set_recv_timeout(int socket, uint16_t milliseconds) {
+#if defined(LWIP_SO_RCVTIMEO) && (!defined(LWIP_SO_SNDRCVTIMEO_NONSTANDARD) || LWIP_SO_SNDRCVTIMEO_NONSTANDARD)
+    // lwIP 1.4 takes the timeout in milliseconds
+    int timeout = milliseconds;
+#else
+    struct timeval timeout;
+    timeout.tv_sec = milliseconds / 1000;
+    timeout.tv_usec = (milliseconds % 1000) * 1000;
+#endif
+    if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) {
+        LOG(WARN, "shttp: Could not set receive timeout");
+    }
+}
+
+static void shttp_parked_lock(void) {
+    uint8_t token;
+    xQueueReceive(parkedLock, &token, portMAX_DELAY);
+}
+
+static void shttp_parked_unlock(void) {
+    uint8_t token = 0;
+    xQueueSend(parkedLock, &token, 0);
+}
+
+static void shttp_close_parked(shttpParkedConnection *connection) {
+    close(connection->socket);
+    if (connection->state.websocket.callback != NULL) {
+        shttp_websocket_release();
+    }
+}
+
+// make room for a WebSocket by closing an idle persistent connection,
+// call with the lock held
+static bool shttp_evict_parked(void) {
+    for (uint8_t i = 0; i < numParked; i++) {
+        if (parked[i].state.websocket.callback == NULL) {
+            LOG(DEBUG, "shttp: closing parked connection for a WebSocket");
+            shttp_close_parked(&parked[i]);
+            parked[i] = parked[--numParked];
+            return true;
+        }
+    }
+    return false;
+}
+
+// hand the connection of `worker` to the accepting task if it is idle and
+// other connections wait for a worker, WebSockets whenever they are idle.
+// Returns shttpConnectionDetached if it has been parked,
+// shttpConnectionClose if it is idle but there is no room to park it and
+// shttpConnectionKeepAlive to go on serving it
+static shttpConnectionState shttp_park_connection(shttpWorker *worker, int socket) {
+    shttpParkedConnection connection = { socket, xTaskGetTickCount(), false };
+    if (!shttp_parser_park(worker->parser, &connection.state)) {
+        // in the middle of a request or frame
+        return shttpConnectionKeepAlive;
+    }
+
+    bool websocket = (connection.state.websocket.callback != NULL);
+    if ((!websocket) && (uxQueueMessagesWaiting(connectionQueue) == 0)) {
+        shttp_parser_resume(worker->parser, &connection.state);
+        return shttpConnectionKeepAlive;
+    }
+
+    shttp_parked_lock();
+    bool ok = (numParked < SHTTP_MAX_PARKED_CONNECTIONS) || ((websocket) && (shttp_evict_parked()));
+    if (ok) {
+        parked[numParked++] = connection;
+    }
+    shttp_parked_unlock();
+
+    if (!ok) {
+        // a WebSocket stays with the worker, an idle connection is closed
+        shttp_parser_resume(worker->parser, &connection.state);
+        LOG(DEBUG, "shttp: no room to park idle connection");
+        return (websocket) ? shttpConnectionKeepAlive : shttpConnectionClose;
+    }
+    LOG(DEBUG, "shttp: connection parked");
+    return shttpConnectionDetached;
+}
+
 void readTask(void *userData) {
+    shttpWorker *worker = (shttpWorker *)userData;
+    shttpQueuedConnection connection;
     int socket;
-    char *recv_buffer;
     int result;
-    shttpParserState *parser;
+    uint16_t space;
+    shttpConnectionState state;
 
     while(1) {
         // fetch a connection from the queue
-        xQueueReceive(connectionQueue, &socket, portMAX_DELAY);
-
-        // allocate receive buffer
-        recv_buffer = malloc(SHTTP_MAX_RECV_BUFFER);
-        if (recv_buffer == NULL) {
-            LOG(ERROR, "shttp: Out of memory, terminating connection");
-            close(socket);
-            continue;
+        xQueueReceive(connectionQueue, &connection, portMAX_DELAY);
+        socket = connection.socket;
+        shttp_parser_start(worker->parser, connection.accepted);
+        if (connection.resumed) {
+            shttp_parser_resume(worker->parser, &connection.parked);
+        } else {
+            shttp_set_nodelay(socket);
         }
 
-        // create a parser
-        parser = shttp_parser_init_state();
+        // wake up regularly to see if the connection is idle while
+        // others are waiting
+        shttp_set_recv_timeout(socket, SHTTP_PARK_INTERVAL);
+        portTickType lastActivity = xTaskGetTickCount();
 
         // receive data
+        state = shttpConnectionClose;
         while(1) {
-            result = recv(socket, recv_buffer, SHTTP_MAX_RECV_BUFFER, 0);
+            // receive straight into the connection buffer of the parser
+            char *buffer = shttp_parser_buffer(worker->parser, &space);
+            result = recv(socket, buffer, space, 0);
             if (result <= 0) {
-                if ((errno == EPIPE) || (errno == ECONNRESET) || (result == 0)) {
-                    // client disconnected
-                    LOG(DEBUG, "shttp: client disconnected");
-                    close(socket);
-                    break;
-                }
-                
-                if (errno == EINTR) {
+                if ((result < 0) && (errno == EINTR)) {
                     // interrupted, try again
                     continue;
                 }
+                if ((result < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+                    state = shttp_park_connection(worker, socket);
+                    if (state != shttpConnectionKeepAlive) {
+                        break;
+                    }
+
+                    portTickType now = xTaskGetTickCount();
+                    if ((now - lastActivity) * portTICK_RATE_MS < SHTTP_IDLE_TIMEOUT) {
+                        continue;
+                    }
+                    lastActivity = now;
+                    if (shttp_parser_idle(worker->parser) == shttpConnectionKeepAlive) {
+                        // idle timeout, but the connection wants to stay
+                        continue;
+                    }
+                    state = shttpConnectionClose;
+                }
+
+                // client disconnected, idle timeout or socket error
+                LOG(DEBUG, "shttp: client disconnected");
+                break;
             } else {
                 // received some bytes, run parser on it
-                if (!shttp_parse(parser, recv_buffer, result, socket)) {
+                lastActivity = xTaskGetTickCount();
+                state = shttp_parse(worker->parser, result, socket);
+                if (state != shttpConnectionKeepAlive) {
                     // parser thinks we should close the connection
                     LOG(DEBUG, "shttp: parse called for quit");
                     break;
                 }
+
+                // make room for waiting connections right after the response
+                state = shttp_park_connection(worker, socket);
+                if (state != shttpConnectionKeepAlive) {
+                    break;
+                }
             }
         }
 
-        // clean up
-        free(recv_buffer);
-        shttp_destroy_parser(parser);
+        // clean up, the parser state is re-used for the next connection
+        shttp_parser_reset(worker->parser);
+        if (state == shttpConnectionDetached) {
+            // the socket belongs to a response or the parked connections now
+            LOG(DEBUG, "shttp: connection handed over");
+            continue;
+        }
         close(socket);
         LOG(DEBUG, "shttp: connection closed");
     }
 }
 
-void shttp_listen(shttpConfig *config) {
-    struct sockaddr_in clientAddr;
-    socklen_t addrLen;
-    int incomingSocket;
+// queue the parked connections that received something, close the ones
+// idle for too long. Idle WebSockets are pinged first
+static void shttp_wake_parked(fd_set *readSet) {
+    shttpQueuedConnection ready[SHTTP_MAX_PARKED_CONNECTIONS];
+    uint8_t numReady = 0;
+    portTickType now = xTaskGetTickCount();
 
-    // bind and listen
-    bool result = bind_and_listen(config->port);
-    if (result == false){
-        LOG(ERROR, "shttp: Giving up");
-        return;
+    shttp_parked_lock();
+    uint8_t i = 0;
+    while (i < numParked) {
+        shttpParkedConnection *connection = &parked[i];
+        if ((connection->watched) && FD_ISSET(connection->socket, readSet)) {
+            ready[numReady++] = (shttpQueuedConnection){ connection->socket, shttp_metrics_now(), true, connection->state };
+        } else if ((now - connection->since) * portTICK_RATE_MS >= SHTTP_IDLE_TIMEOUT) {
+            if ((connection->state.websocket.callback != NULL) &&
+                (shttp_websocket_idle(&connection->state.websocket) == shttpConnectionKeepAlive)) {
+                connection->since = now;
+                i++;
+                continue;
+            }
+            LOG(DEBUG, "shttp: closing idle parked connection");
+            shttp_close_parked(connection);
+        } else {
+            i++;
+            continue;
+        }
+        parked[i] = parked[--numParked];
+    }
+    shttp_parked_unlock();
+
+    // outside of the lock, the workers may need it to make room in the queue
+    for (i = 0; i < numReady; i++) {
+        xQueueSendToBack(connectionQueue, &ready[i], portMAX_DELAY);
+    }
+}
+
+static void shttp_destroy_parked(void) {
+    for (uint8_t i = 0; i < numParked; i++) {
+        shttp_close_parked(&parked[i]);
+    }
+    numParked = 0;
+    vQueueDelete(parkedLock);
+}
+
+static void shttp_destroy_workers(void) {
+    for (uint8_t i = 0; i < SHTTP_WORKERS; i++) {
+        if (workers[i].task) {
+            vTaskDelete(workers[i].task);
+            workers[i].task = NULL;
+        }
+        if (workers[i].parser) {
+            shttp_destroy_parser(workers[i].parser);
+            workers[i].parser = NULL;
+        }
     }
+}
+
+static bool shttp_start_workers(void) {
+    char name[16];
+
+    for (uint8_t i = 0; i < SHTTP_WORKERS; i++) {
+        // allocate parser (and with it the receive buffer) up front
+        workers[i].parser = shttp_parser_init_state(staticChunks[i]);
+        if (workers[i].parser == NULL) {
+            LOG(ERROR, "shttp: Out of memory while creating worker %d", i);
+            return false;
+        }
+
+        // start data processing task
+        sprintf(name, "shttp.read%d", i);
+        if (xTaskCreate(readTask, name, SHTTP_STACK_SIZE, &workers[i], SHTTP_PRIO, &workers[i].task) != pdPASS) {
+            LOG(ERROR, "shttp: Could not create data processing task %d", i);
+            workers[i].task = NULL;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void shttp_stop_workers(void) {
+    shttp_destroy_workers();
+    shttp_destroy_parked();
+    vQueueDelete(connectionQueue);
+}
+
+// accept connections and watch the parked ones, both are queued for the workers
+static void shttp_run_workers(void) {
+    struct sockaddr_in clientAddr;
+    socklen_t addrLen;
+    shttpQueuedConnection incoming;
+    fd_set readSet;
+    struct timeval timeout;
 
     // Create data processing queue
-    connectionQueue = xQueueCreate(SHTTP_MAX_QUEUED_CONNECTIONS, sizeof(int));
+    connectionQueue = xQueueCreate(SHTTP_MAX_QUEUED_CONNECTIONS, sizeof(shttpQueuedConnection));
     if (connectionQueue == NULL) {
         LOG(ERROR, "shttp: Could not create connection queue, terminating");
-        close(listeningSocket);
         return;
     }
-
-    // start data processing task
-    if (xTaskCreate(readTask, "shttp.read", SHTTP_STACK_SIZE, NULL, SHTTP_PRIO, &dataTask) != pdPASS) {
-        LOG(ERROR, "shttp: Could not create data processing task, terminating");
+    parkedLock = xQueueCreate(1, sizeof(uint8_t));
+    if (parkedLock == NULL) {
+        LOG(ERROR, "shttp: Could not create parked connection lock, terminating");
         vQueueDelete(connectionQueue);
-        close(listeningSocket);
+        return;
+    }
+    shttp_parked_unlock();
+
+    // start data processing tasks
+    if (!shttp_start_workers()) {
+        LOG(ERROR, "shttp: Could not start workers, terminating");
+        shttp_stop_workers();
         return;
     }
 
-    shttpServerConfig = config;
     LOG(DEBUG, "shttp: server ready to accept connections");
 
-    // accept connections
+    portTickType lastKeepAlive = xTaskGetTickCount();
     while(1) {
-        addrLen = sizeof(clientAddr);
+        FD_ZERO(&readSet);
+        FD_SET(listeningSocket, &readSet);
+        int maxSocket = listeningSocket;
 
-        // this blocks until a client connects
-        incomingSocket = accept(listeningSocket, (struct sockaddr *) &clientAddr, &addrLen);
-        if (incomingSocket < 0) {
+        shttp_parked_lock();
+        for (uint8_t i = 0; i < numParked; i++) {
+            FD_SET(parked[i].socket, &readSet);
+            maxSocket = MAX(maxSocket, parked[i].socket);
+            parked[i].watched = true;
+        }
+        shttp_parked_unlock();
+
+        // workers park connections while this waits, look for them regularly
+        timeout.tv_sec = SHTTP_PARK_INTERVAL / 1000;
+        timeout.tv_usec = (SHTTP_PARK_INTERVAL % 1000) * 1000;
+        int ready = select(maxSocket + 1, &readSet, NULL, NULL, &timeout);
+        if (ready < 0) {
             if (errno == EINTR) {
                 continue;
             }
-            LOG(ERROR, "shttp: Could not accept connection, terminating");
-            vTaskDelete(dataTask);
-            vQueueDelete(connectionQueue);
-            close(listeningSocket);
+            LOG(ERROR, "shttp: select failed, terminating");
+            shttp_stop_workers();
+            return;
+        }
+        if (ready == 0) {
+            FD_ZERO(&readSet);
+        }
+
+        if (FD_ISSET(listeningSocket, &readSet)) {
+            addrLen = sizeof(clientAddr);
+            incoming.socket = accept(listeningSocket, (struct sockaddr *) &clientAddr, &addrLen);
+            if (incoming.socket >= 0) {
+                LOG(TRACE, "shttp: Client connected, signaling communications thread");
+                incoming.accepted = shttp_metrics_now();
+                incoming.resumed = false;
+                xQueueSendToBack(connectionQueue, &incoming, portMAX_DELAY);
+                shttp_metrics_connection(uxQueueMessagesWaiting(connectionQueue));
+            } else if (errno != EINTR) {
+                LOG(WARN, "shttp: Could not accept connection");
+            }
+        }
+
+        shttp_wake_parked(&readSet);
+
+        // event streams are idle between events, keep them open
+        portTickType now = xTaskGetTickCount();
+        if ((now - lastKeepAlive) * portTICK_RATE_MS >= SHTTP_IDLE_TIMEOUT) {
+            shttp_events_keepalive();
+            lastKeepAlive = now;
+        }
+    }
+}
+#else
+static void shttp_close_connection(shttpConnection *connection) {
+    shttp_parser_reset(connection->parser);
+    close(connection->socket);
+    connection->socket = -1;
+    LOG(DEBUG, "shttp: connection closed");
+}
+
+// free the slot of a connection a response took over, without closing it
+static void shttp_detach_connection(shttpConnection *connection) {
+    shttp_parser_reset(connection->parser);
+    connection->socket = -1;
+    LOG(DEBUG, "shttp: connection handed over");
+}
+
+static void shttp_destroy_connections(void) {
+    for (uint8_t i = 0; i < SHTTP_MAX_CONNECTIONS; i++) {
+        if (connections[i].socket >= 0) {
+            close(connections[i].socket);
+            connections[i].socket = -1;
+        }
+        if (connections[i].parser) {
+            shttp_destroy_parser(connections[i].parser);
+            connections[i].parser = NULL;
+        }
+    }
+}
+
+static bool shttp_create_connections(void) {
+    for (uint8_t i = 0; i < SHTTP_MAX_CONNECTIONS; i++) {
+        connections[i].socket = -1;
+        connections[i].parser = shttp_parser_init_state(staticChunk);
+        if (connections[i].parser == NULL) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void shttp_accept_connection(portTickType now, uint8_t numConnections) {
+    struct sockaddr_in clientAddr;
+    socklen_t addrLen = sizeof(clientAddr);
+
+    int incomingSocket = accept(listeningSocket, (struct sockaddr *) &clientAddr, &addrLen);
+    if (incomingSocket < 0) {
+        LOG(WARN, "shttp: Could not accept connection");
+        return;
+    }
+
+    // the listening socket is only watched if there is a free slot
+    for (uint8_t i = 0; i < SHTTP_MAX_CONNECTIONS; i++) {
+        if (connections[i].socket < 0) {
+            LOG(TRACE, "shttp: Client connected, slot %d", i);
+            shttp_set_nodelay(incomingSocket);
+            connections[i].socket = incomingSocket;
+            connections[i].lastActivity = now;
+            shttp_parser_start(connections[i].parser, shttp_metrics_now());
+            shttp_metrics_connection(numConnections + 1);
             return;
         }
+    }
+
+    LOG(ERROR, "shttp: No free connection slot");
+    close(incomingSocket);
+}
 
-        LOG(TRACE, "shttp: Client connected, signaling communications thread");
-        xQueueSendToBack(connectionQueue, &incomingSocket, portMAX_DELAY);
+static void shttp_read_connection(shttpConnection *connection, portTickType now) {
+    // receive straight into the connection buffer of the parser
+    uint16_t space;
+    char *buffer = shttp_parser_buffer(connection->parser, &space);
+    int result = recv(connection->socket, buffer, space, 0);
+    if (result <= 0) {
+        if ((result < 0) && (errno == EINTR)) {
+            // interrupted, select will report the socket again
+            return;
+        }
+
+        // client disconnected or socket error
+        LOG(DEBUG, "shttp: client disconnected");
+        shttp_close_connection(connection);
+        return;
+    }
+
+    // received some bytes, run parser on it
+    connection->lastActivity = now;
+    shttpConnectionState state = shttp_parse(connection->parser, result, connection->socket);
+    if (state == shttpConnectionDetached) {
+        shttp_detach_connection(connection);
+    } else if (state == shttpConnectionClose) {
+        // parser thinks we should close the connection
+        LOG(DEBUG, "shttp: parse called for quit");
+        shttp_close_connection(connection);
+    }
+}
+
+// Multiplex the listening socket and all client sockets in this task.
+// Requests are parsed incrementally as data arrives, so an idle or slow
+// client does not hold up others. Responses are still sent blocking.
+static void shttp_run_event_loop(void) {
+    fd_set readSet;
+    struct timeval timeout;
+
+    if (!shttp_create_connections()) {
+        LOG(ERROR, "shttp: Out of memory while creating connections, terminating");
+        shttp_destroy_connections();
+        return;
     }
+
+    LOG(DEBUG, "shttp: server ready to accept connections");
+
+    portTickType lastKeepAlive = xTaskGetTickCount();
+    while(1) {
+        FD_ZERO(&readSet);
+        int maxSocket = -1;
+        uint8_t numConnections = 0;
+
+        for (uint8_t i = 0; i < SHTTP_MAX_CONNECTIONS; i++) {
+            if (connections[i].socket >= 0) {
+                FD_SET(connections[i].socket, &readSet);
+                maxSocket = MAX(maxSocket, connections[i].socket);
+                numConnections++;
+            }
+        }
+
+        // when all slots are in use new clients wait in the listen backlog
+        if (numConnections < SHTTP_MAX_CONNECTIONS) {
+            FD_SET(listeningSocket, &readSet);
+            maxSocket = MAX(maxSocket, listeningSocket);
+        }
+
+        // wake up regularly to close idle connections
+        timeout.tv_sec = 1;
+        timeout.tv_usec = 0;
+        int ready = select(maxSocket + 1, &readSet, NULL, NULL, &timeout);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            LOG(ERROR, "shttp: select failed, terminating");
+            shttp_destroy_connections();
+            return;
+        }
+
+        portTickType now = xTaskGetTickCount();
+
+        if ((ready > 0) && FD_ISSET(listeningSocket, &readSet)) {
+            shttp_accept_connection(now, numConnections);
+        }
+
+        for (uint8_t i = 0; i < SHTTP_MAX_CONNECTIONS; i++) {
+            shttpConnection *connection = &connections[i];
+            if (connection->socket < 0) {
+                continue;
+            }
+
+            if ((ready > 0) && FD_ISSET(connection->socket, &readSet)) {
+                shttp_read_connection(connection, now);
+            } else if ((now - connection->lastActivity) * portTICK_RATE_MS > SHTTP_IDLE_TIMEOUT) {
+                if (shttp_parser_idle(connection->parser) == shttpConnectionKeepAlive) {
+                    connection->lastActivity = now;
+                    continue;
+                }
+                LOG(DEBUG, "shttp: closing idle connection");
+                shttp_close_connection(connection);
+            }
+        }
+
+        // event streams are idle between events, keep them open
+        if ((now - lastKeepAlive) * portTICK_RATE_MS >= SHTTP_IDLE_TIMEOUT) {
+            shttp_events_keepalive();
+            lastKeepAlive = now;
+        }
+    }
+}
+#endif /* SHTTP_EVENT_LOOP */
+
+void shttp_listen(shttpConfig *config) {
+    // bind and listen
+    bool result = bind_and_listen(config->port);
+    if (result == false){
+        LOG(ERROR, "shttp: Giving up");
+        return;
+    }
+
+    // processing may start right away, so publish the config first
+    shttpServerConfig = config;
+    if (!shttp_compile_routes(config->routes)) {
+        LOG(ERROR, "shttp: Could not compile routes, giving up");
+        close(listeningSocket);
+        return;
+    }
+    if (!shttp_metrics_init(config->routes)) {
+        LOG(ERROR, "shttp: Could not set up metrics, giving up");
+        shttp_destroy_routes();
+        close(listeningSocket);
+        return;
+    }
+    if (!shttp_websocket_init()) {
+        LOG(ERROR, "shttp: Could not set up WebSockets, giving up");
+        shttp_metrics_destroy(config->routes);
+        shttp_destroy_routes();
+        close(listeningSocket);
+        return;
+    }
+
+#if SHTTP_EVENT_LOOP
+    shttp_run_event_loop();
+#else
+    shttp_run_workers();
+#endif
+
+    // only returns on fatal errors
+    shttp_metrics_destroy(config->routes);
+    shttp_destroy_routes();
+    close(listeningSocket);
 }
@@ -6,4 +6,7 @@
 char *shttp_url_decode_buffer(char *buffer, uint8_t len);
 char *shttp_url_encode_buffer(char *buffer, uint8_t len);
 
+// decode `len` bytes in place and zero terminate them, returns the new length
+uint16_t shttp_url_decode_inplace(char *buffer, uint16_t len);
+
 #endif /* shttp_urlcoder_h_included */
\ No newline at end of file
@@ -0,0 +1,395 @@
+#include "simplehttp/http.h"
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#include "debug.h"
+#include "websocket.h"
+#include "response.h"
+
+// appended to the key of the client for the accept hash (RFC 6455)
+#define SHTTP_WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// close status codes
+#define SHTTP_WEBSOCKET_NORMAL 1000
+#define SHTTP_WEBSOCKET_PROTOCOL_ERROR 1002
+#define SHTTP_WEBSOCKET_TOO_BIG 1009
+
+// holds one token while nobody counts the open WebSockets
+static xQueueHandle websocketLock;
+static uint8_t numWebSockets;
+
+static void shttp_websocket_lock(void) {
+    uint8_t token;
+    xQueueReceive(websocketLock, &token, portMAX_DELAY);
+}
+
+static void shttp_websocket_unlock(void) {
+    uint8_t token = 0;
+    xQueueSend(websocketLock, &token, 0);
+}
+
+// count a WebSocket that is about to open, false if there are too many
+static bool shttp_websocket_reserve(void) {
+    shttp_websocket_lock();
+    bool ok = (numWebSockets < SHTTP_MAX_WEBSOCKETS);
+    if (ok) {
+        numWebSockets++;
+    }
+    shttp_websocket_unlock();
+    return ok;
+}
+
+// request cleanup of the handshake, the upgrade did not happen
+static void *shttp_websocket_unreserve(void *userData) {
+    shttp_websocket_release();
+    return NULL;
+}
+
+//
+// Handshake
+//
+
+static uint32_t shttp_rol(uint32_t value, uint8_t bits) {
+    return (value << bits) | (value >> (32 - bits));
+}
+
+static void shttp_sha1_block(uint32_t *hash, const uint8_t *block) {
+    // the message schedule is kept as a ring of 16 words to save stack
+    uint32_t w[16];
+    for (uint8_t i = 0; i < 16; i++) {
+        w[i] = (block[i * 4] << 24) | (block[i * 4 + 1] << 16) | (block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+
+    uint32_t a = hash[0], b = hash[1], c = hash[2], d = hash[3], e = hash[4];
+    for (uint8_t i = 0; i < 80; i++) {
+        if (i >= 16) {
+            w[i & 15] = shttp_rol(w[(i + 13) & 15] ^ w[(i + 8) & 15] ^ w[(i + 2) & 15] ^ w[i & 15], 1);
+        }
+
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        uint32_t temp = shttp_rol(a, 5) + f + e + k + w[i & 15];
+        e = d;
+        d = c;
+        c = shttp_rol(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    hash[0] += a;
+    hash[1] += b;
+    hash[2] += c;
+    hash[3] += d;
+    hash[4] += e;
+}
+
+static void shttp_sha1(const uint8_t *data, uint16_t len, uint8_t *digest) {
+    uint32_t hash[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    uint8_t block[64];
+    uint16_t position = 0;
+
+    for (; position + 64 <= len; position += 64) {
+        shttp_sha1_block(hash, data + position);
+    }
+
+    // padding and message length in bits
+    memset(block, 0, 64);
+    memcpy(block, data + position, len - position);
+    block[len - position] = 0x80;
+    if (len - position >= 56) {
+        shttp_sha1_block(hash, block);
+        memset(block, 0, 64);
+    }
+    uint32_t bits = (uint32_t)len * 8;
+    block[60] = bits >> 24;
+    block[61] = bits >> 16;
+    block[62] = bits >> 8;
+    block[63] = bits;
+    shttp_sha1_block(hash, block);
+
+    for (uint8_t i = 0; i < 20; i++) {
+        digest[i] = hash[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+// `out` needs room for 4 * ((len + 2) / 3) + 1 bytes
+static void shttp_base64_encode(const uint8_t *data, uint16_t len, char *out) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    for (uint16_t i = 0; i < len; i += 3) {
+        uint32_t value = data[i] << 16;
+        if (i + 1 < len) {
+            value |= data[i + 1] << 8;
+        }
+        if (i + 2 < len) {
+            value |= data[i + 2];
+        }
+
+        *out++ = alphabet[(value >> 18) & 0x3f];
+        *out++ = alphabet[(value >> 12) & 0x3f];
+        *out++ = (i + 1 < len) ? alphabet[(value >> 6) & 0x3f] : '=';
+        *out++ = (i + 2 < len) ? alphabet[value & 0x3f] : '=';
+    }
+    *out = '\0';
+}
+
+// true if the comma separated known header lists `token`
+static bool shttp_websocket_header_has(shttpRequest *request, shttpKnownHeader header, const char *token) {
+    char *value = shttp_request_header(request, header);
+    uint16_t tokenLen = strlen(token);
+
+    while ((value != NULL) && (*value != '\0')) {
+        while ((*value == ' ') || (*value == ',')) {
+            value++;
+        }
+        uint16_t len = strcspn(value, " ,");
+        if ((len == tokenLen) && (strncasecmp(value, token, len) == 0)) {
+            return true;
+        }
+        value += len;
+    }
+    return false;
+}
+
+//
+// Frames
+//
+
+static bool shttp_websocket_close(shttpWebSocket *websocket, uint16_t code) {
+    char status[2] = { code >> 8, code & 0xff };
+    return shttp_websocket_send(websocket, shttpWebSocketClose, status, 2);
+}
+
+// handle one unmasked frame, returns false if the connection ends
+static bool shttp_websocket_frame(shttpWebSocket *websocket, bool final, uint8_t opcode, char *payload, uint16_t len) {
+    switch (opcode) {
+        case shttpWebSocketContinuation:
+        case shttpWebSocketText:
+        case shttpWebSocketBinary: {
+            // zero terminate the payload for the callback, the byte
+            // behind it may belong to the next frame
+            char next = payload[len];
+            payload[len] = '\0';
+            bool result = websocket->callback(websocket, opcode, final, payload, len, websocket->userData);
+            payload[len] = next;
+
+            if (!result) {
+                shttp_websocket_close(websocket, SHTTP_WEBSOCKET_NORMAL);
+            }
+            return result;
+        }
+
+        case shttpWebSocketClose:
+            // answer with the status code of the client
+            LOG(DEBUG, "shttp: WebSocket closed by client");
+            shttp_websocket_send(websocket, shttpWebSocketClose, payload, (len >= 2) ? 2 : 0);
+            return false;
+
+        case shttpWebSocketPing:
+            return shttp_websocket_send(websocket, shttpWebSocketPong, payload, len);
+
+        case shttpWebSocketPong:
+            return true;
+    }
+
+    LOG(WARN, "shttp: unknown WebSocket opcode %d", opcode);
+    shttp_websocket_close(websocket, SHTTP_WEBSOCKET_PROTOCOL_ERROR);
+    return false;
+}
+
+//
+// Internal API
+//
+
+bool shttp_websocket_init(void) {
+    if (websocketLock == NULL) {
+        websocketLock = xQueueCreate(1, sizeof(uint8_t));
+        if (websocketLock == NULL) {
+            return false;
+        }
+        shttp_websocket_unlock();
+    }
+    return true;
+}
+
+void shttp_websocket_release(void) {
+    shttp_websocket_lock();
+    numWebSockets--;
+    shttp_websocket_unlock();
+}
+
+shttpResponse *shttp_websocket_handshake(shttpRequest *request, void *userData) {
+    char *key = shttp_request_header(request, SHTTP_HDR_SEC_WEBSOCKET_KEY);
+    char *version = shttp_request_header(request, SHTTP_HDR_SEC_WEBSOCKET_VERSION);
+
+    if ((!shttp_websocket_header_has(request, SHTTP_HDR_UPGRADE, "websocket")) ||
+        (!shttp_websocket_header_has(request, SHTTP_HDR_CONNECTION, "upgrade")) ||
+        (key == NULL) || (strlen(key) != 24)) {
+        LOG(DEBUG, "shttp: invalid WebSocket handshake");
+        return shttp_empty_response(shttpStatusBadRequest);
+    }
+
+    if ((version == NULL) || (strcmp(version, "13") != 0)) {
+        shttpResponse *response = shttp_empty_response(shttpStatusUpgradeRequired);
+        shttp_response_add_headers(response, "Sec-WebSocket-Version", "13", NULL);
+        return response;
+    }
+
+    if (!shttp_websocket_reserve()) {
+        LOG(WARN, "shttp: too many WebSockets");
+        return shttp_empty_response(shttpStatusServiceUnavailable);
+    }
+    // until the parser takes over the connection
+    request->cleanupCallback = shttp_websocket_unreserve;
+
+    // the accept value proves the server understood the handshake
+    uint8_t digest[20];
+    char keyAndGUID[24 + sizeof(SHTTP_WEBSOCKET_GUID)];
+    char accept[29];
+    memcpy(keyAndGUID, key, 24);
+    memcpy(keyAndGUID + 24, SHTTP_WEBSOCKET_GUID, sizeof(SHTTP_WEBSOCKET_GUID));
+    shttp_sha1((uint8_t *)keyAndGUID, strlen(keyAndGUID), digest);
+    shttp_base64_encode(digest, 20, accept);
+
+    shttpResponse *response = shttp_empty_response(shttpStatusSwitchingProtocols);
+    shttp_response_add_headers(response,
+        "Upgrade", "websocket",
+        "Connection", "Upgrade",
+        "Sec-WebSocket-Accept", accept,
+        NULL);
+    return response;
+}
+
+uint16_t shttp_websocket_parse(shttpWebSocket *websocket, char *data, uint16_t len, uint32_t *frameSize, shttpConnectionState *state) {
+    uint16_t used = 0;
+
+    *frameSize = 0;
+    *state = shttpConnectionKeepAlive;
+    while (len - used >= 2) {
+        uint8_t *frame = (uint8_t *)data + used;
+        uint16_t available = len - used;
+
+        bool final = (frame[0] & 0x80) != 0;
+        uint8_t opcode = frame[0] & 0x0f;
+        bool masked = (frame[1] & 0x80) != 0;
+
+        // 7 bit length or a 16 or 64 bit length following
+        uint8_t headerLen = 2;
+        uint32_t payloadLen = frame[1] & 0x7f;
+        if (payloadLen == 126) {
+            if (available < 4) {
+                break;
+            }
+            payloadLen = (frame[2] << 8) | frame[3];
+            headerLen = 4;
+        } else if (payloadLen == 127) {
+            if (available < 10) {
+                break;
+            }
+            // anything above 32 bit is too big anyway
+            bool huge = (frame[2] | frame[3] | frame[4] | frame[5]) != 0;
+            payloadLen = (huge) ? UINT32_MAX : (uint32_t)((frame[6] << 24) | (frame[7] << 16) | (frame[8] << 8) | frame[9]);
+            headerLen = 10;
+        }
+
+        // clients always mask their frames
+        if (!masked) {
+            LOG(WARN, "shttp: unmasked WebSocket frame");
+            shttp_websocket_close(websocket, SHTTP_WEBSOCKET_PROTOCOL_ERROR);
+            *state = shttpConnectionClose;
+            return used;
+        }
+        if (payloadLen > SHTTP_MAX_BODY_SIZE) {
+            LOG(WARN, "shttp: WebSocket frame too big");
+            shttp_websocket_close(websocket, SHTTP_WEBSOCKET_TOO_BIG);
+            *state = shttpConnectionClose;
+            return used;
+        }
+
+        uint8_t *mask = frame + headerLen;
+        headerLen += 4;
+        if (available < headerLen + payloadLen) {
+            *frameSize = headerLen + payloadLen;
+            break;
+        }
+
+        char *payload = (char *)frame + headerLen;
+        for (uint16_t i = 0; i < payloadLen; i++) {
+            payload[i] ^= mask[i & 3];
+        }
+        used += headerLen + payloadLen;
+
+        // the client is alive
+        websocket->pingSent = false;
+        if (!shttp_websocket_frame(websocket, final, opcode, payload, payloadLen)) {
+            *state = shttpConnectionClose;
+            return used;
+        }
+    }
+
+    return used;
+}
+
+shttpConnectionState shttp_websocket_idle(shttpWebSocket *websocket) {
+    if (websocket->pingSent) {
+        LOG(DEBUG, "shttp: WebSocket client did not answer ping");
+        return shttpConnectionClose;
+    }
+
+    websocket->pingSent = shttp_websocket_send(websocket, shttpWebSocketPing, NULL, 0);
+    return (websocket->pingSent) ? shttpConnectionKeepAlive : shttpConnectionClose;
+}
+
+//
+// API
+//
+
+bool shttp_websocket_send(shttpWebSocket *websocket, shttpWebSocketOpcode opcode, const char *data, uint16_t len) {
+    // server frames are not masked, small ones go out in one write
+    char buffer[SHTTP_RESPONSE_BUFFER];
+    uint8_t headerLen = 2;
+
+    buffer[0] = 0x80 | opcode;
+    if (len < 126) {
+        buffer[1] = len;
+    } else {
+        buffer[1] = 126;
+        buffer[2] = len >> 8;
+        buffer[3] = len & 0xff;
+        headerLen = 4;
+    }
+
+    if (headerLen + len <= SHTTP_RESPONSE_BUFFER) {
+        if (len > 0) {
+            memcpy(buffer + headerLen, data, len);
+        }
+        return shttp_send_all(websocket->socket, buffer, headerLen + len);
+    }
+    return shttp_send_all(websocket->socket, buffer, headerLen) && shttp_send_all(websocket->socket, data, len);
+}
+
+shttpRoute *shttp_websocket_route(char *path, shttpWebSocketCallback *callback, void *userData) {
+    shttpRoute *route = shttp_route(shttpMethodGET, path, shttp_websocket_handshake, userData);
+    if (route != NULL) {
+        route->websocketCallback = callback;
+    }
+
+    return route;
+}
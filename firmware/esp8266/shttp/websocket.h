@@ -0,0 +1,33 @@
+#ifndef shttp_websocket_h_included
+#define shttp_websocket_h_included
+
+#include "simplehttp/http.h"
+#include "response.h"
+
+// a connection upgraded to the WebSocket protocol, part of the parser state
+struct _shttpWebSocket {
+    int socket;
+    shttpWebSocketCallback *callback;
+    void *userData;
+
+    // a ping is outstanding, the next idle timeout closes the connection
+    bool pingSent;
+};
+
+// set up counting the open WebSockets, call before the server starts
+bool shttp_websocket_init(void);
+
+// a WebSocket counted by the opening handshake has been closed
+void shttp_websocket_release(void);
+
+// route callback of WebSocket routes, answers the opening handshake
+shttpResponse *shttp_websocket_handshake(shttpRequest *request, void *userData);
+
+// handle the complete frames in `data`, returns the number of bytes used.
+// If a frame is incomplete `frameSize` is set to its full size.
+uint16_t shttp_websocket_parse(shttpWebSocket *websocket, char *data, uint16_t len, uint32_t *frameSize, shttpConnectionState *state);
+
+// the client did not send anything for SHTTP_IDLE_TIMEOUT, ping it
+shttpConnectionState shttp_websocket_idle(shttpWebSocket *websocket);
+
+#endif /* shttp_websocket_h_included */
@@ -1,4 +1,28 @@
+// parameters go over a WebSocket while one is open, that avoids a new
+// connection for every slider movement
+let parameterSocket = null;
+
+function openParameterSocket() {
+    if (!window.WebSocket) {
+        return;
+    }
+
+    const socket = new WebSocket(`ws://${window.location.host}/parameters/socket`);
+    socket.onopen = () => {
+        parameterSocket = socket;
+    };
+    socket.onclose = () => {
+        parameterSocket = null;
+        setTimeout(openParameterSocket, 2000);
+    };
+}
+
 function sendParameter(dict) {
+    if (parameterSocket) {
+        parameterSocket.send(JSON.stringify(dict));
+        return;
+    }
+
     const xhr = new XMLHttpRequest();
 
     xhr.open('POST', '/parameters');
@@ -7,6 +31,23 @@ function sendParameter(dict) {
     xhr.send(JSON.stringify(dict));
 }
 
+// last known colour, change events only carry the changed half of it
+const color = { hue: 0.0, saturation: 1.0 };
+
+// mark the current colour on the wheel, the inverse of the click handler
+// below: the hue is the angle clockwise from the top, the saturation the
+// distance from the center
+function showColor() {
+    const colorwheel = document.getElementById('colorwheel');
+    const marker = document.getElementById('colormarker');
+    const angle = color.hue * 2.0 * Math.PI;
+    const dist = color.saturation * 144.0;
+
+    marker.style.left = `${colorwheel.offsetLeft + colorwheel.offsetWidth / 2.0 + Math.sin(angle) * dist}px`;
+    marker.style.top = `${colorwheel.offsetTop + colorwheel.offsetHeight / 2.0 - Math.cos(angle) * dist}px`;
+    marker.style.display = 'block';
+}
+
 function attachEventHandlers() {
     const colorwheel = document.getElementById('colorwheel');
     const brightness = document.getElementById('brightness');
@@ -46,11 +87,43 @@ function attachEventHandlers() {
         let dist = Math.abs(Math.sqrt(Math.pow(x, 2) + Math.pow(y, 2)))
         if (dist > 144) dist = 144;
 
-        sendParameter({
-            saturation: Math.round(dist / 144.0 * 100.0) / 100.0,
-            hue: Math.round(deg / 360.0 * 100.0) / 100.0,
-        });
+        color.saturation = Math.round(dist / 144.0 * 100.0) / 100.0;
+        color.hue = Math.round(deg / 360.0 * 100.0) / 100.0;
+        showColor();
+        sendParameter({ saturation: color.saturation, hue: color.hue });
     });
 }
 
-attachEventHandlers();
\ No newline at end of file
+// follow changes made by other clients, the first event has all parameters
+function followParameters() {
+    if (!window.EventSource) {
+        return;
+    }
+
+    const modes = { white: 'white', cinema: 'cinema', moodlight: 'mood' };
+    const events = new EventSource('/events');
+    events.onmessage = (event) => {
+        const parameters = JSON.parse(event.data);
+
+        for (const name of ['brightness', 'lowPower', 'highPower']) {
+            if (name in parameters) {
+                document.getElementById(name).value = parameters[name];
+            }
+        }
+        if (('hue' in parameters) || ('saturation' in parameters)) {
+            for (const name of ['hue', 'saturation']) {
+                if (name in parameters) {
+                    color[name] = parameters[name];
+                }
+            }
+            showColor();
+        }
+        if (parameters.mode in modes) {
+            document.getElementById(modes[parameters.mode]).checked = true;
+        }
+    };
+}
+
+attachEventHandlers();
+followParameters();
+openParameterSocket();
\ No newline at end of file